@@ -1,86 +1,400 @@
 #define M61_DISABLE 1
 #include "m61.hh"
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/mman.h>
 
 
-// This file contains a base memory allocator guaranteed not to
-// overwrite freed allocations. No need to understand it.
+// This file contains a base memory allocator that does not reuse
+// freed allocations until they leave a quarantine. No need to understand it.
 
 
 using base_allocation = std::pair<uintptr_t, size_t>;
 
-// `allocs` is a hash table mapping active pointer address to allocation size.
-// `frees` is a vector of freed allocations.
+struct quarantine_entry {
+    base_allocation a;
+    bool mapped;                // from base_calloc's mmap, not malloc
+    bool sealed;                // malloc block with its pages PROT_NONE
+};
+
+// `allocs` is a hash table mapping active pointer address to the block's
+// usable size, which includes malloc's slack after the requested bytes.
+// `quarantine` is a FIFO of freed allocations, holding at most
+// `quarantine_max` bytes. A freed block is filled with `poison_byte` and
+// goes to the tail; blocks are released to the system from the head, and
+// only then can their memory be reused. Eviction checks the poison, so a
+// write through a dangling pointer is reported as long as the block was
+// still quarantined. A block larger than the whole quarantine is not
+// poisoned; the pages it covers are made inaccessible (PROT_NONE) instead.
+// It is never evicted to make room for itself, so it stays quarantined
+// until the next free pushes it out as the oldest entry.
 // Both structures are specialized to use the *system* allocator (not m61).
-static std::unordered_map<uintptr_t, size_t,
+// Each thread has its own copy, so threads never contend here; m61 returns
+// every block to the thread that allocated it. When a thread exits, m61
+// hands its copy to whichever thread takes over its blocks
+// (base_state_get/base_state_set) and marks it orphaned until then
+// (base_state_orphan). All copies are kept on the `base_states` list; at
+// exit, the quarantines of the calling thread and of orphaned copies are
+// checked. Threads still running at exit may be using theirs, so those
+// are skipped.
+//
+// Optionally (base_allocate_slab), small requests come from size-class
+// slabs instead. A slab is a 64KB-aligned region holding a header and
+// equal-sized blocks of one class; slabs are carved from 1MB chunks, so
+// a block's slab header is found by masking its address and no per-block
+// bookkeeping is needed. Freed slab blocks join the tail of their class's
+// FIFO free list and are reused only once `slab_min_free` other blocks of
+// the class are waiting, so a freed block is never handed out right away.
+//
+// base_calloc serves large requests with fresh anonymous mappings, which
+// the kernel has already zeroed. A freed mapping is made inaccessible
+// (PROT_NONE) rather than poisoned and joins the same quarantine; it is
+// unmapped only on eviction, so its addresses are not reused before then.
+
+constexpr size_t slab_size = 65536;
+constexpr size_t slab_chunk_size = 16 * slab_size;
+constexpr size_t slab_min_free = 64;
+constexpr size_t zero_map_min = 128 << 10;
+constexpr size_t quarantine_max = 8 << 20;
+constexpr unsigned char poison_byte = 0xDB;
+static constexpr unsigned slab_classes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+    320, 384, 448, 512, 640, 768, 1024, 1280, 1536, 2048
+};
+constexpr int nslab_classes = sizeof(slab_classes) / sizeof(slab_classes[0]);
+
+// `slab_class_of[(sz + 15) / 16]` is the smallest class that fits `sz`
+struct slab_class_table {
+    unsigned char cls[2048 / 16 + 1];
+    constexpr slab_class_table()
+        : cls() {
+        int c = 0;
+        for (unsigned i = 0; i != sizeof(cls); ++i) {
+            while (slab_classes[c] < i * 16) {
+                ++c;
+            }
+            cls[i] = c;
+        }
+    }
+};
+static constexpr slab_class_table slab_class_of;
+
+struct slab_header {
+    unsigned cls;               // index into `slab_classes`
+    alignas(16) char blocks[0];
+};
+
+struct slab_freelist {
+    void* head;                 // oldest freed block
+    void* tail;                 // newest freed block
+    size_t count;
+    char* next;                 // unused space in the current slab
+    char* end;
+};
+
+struct base_state {
+    std::unordered_map<uintptr_t, size_t,
             std::hash<uintptr_t>, std::equal_to<uintptr_t>,
             system_allocator<std::pair<const uintptr_t, size_t>>> allocs;
-static std::vector<base_allocation, system_allocator<base_allocation>> frees;
+    std::vector<quarantine_entry, system_allocator<quarantine_entry>> quarantine;
+    size_t quarantine_head = 0;         // oldest entry in `quarantine`
+    size_t quarantine_size = 0;         // bytes in `quarantine`
+    slab_freelist slabs[nslab_classes] = {};
+    std::unordered_set<uintptr_t, std::hash<uintptr_t>, std::equal_to<uintptr_t>,
+            system_allocator<uintptr_t>> slab_chunks;
+    char* chunk_next = nullptr;  // unused slabs in the current chunk
+    char* chunk_end = nullptr;
+    std::unordered_map<uintptr_t, size_t,
+            std::hash<uintptr_t>, std::equal_to<uintptr_t>,
+            system_allocator<std::pair<const uintptr_t, size_t>>> mapped;
+    base_state* next = nullptr;         // next on `base_states`
+    int orphaned = 0;                   // its thread exited; see above
+};
+static thread_local base_state* base;
+static base_state* base_states;
 static int disabled;
+static int slab_enabled;
+
+static base_state* base_get() {
+    // never destroyed: the thread's freed blocks stay reserved until exit
+    if (!base) {
+        base_state* b = new (system_allocator<base_state>().allocate(1)) base_state;
+        b->next = __atomic_load_n(&base_states, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&base_states, &b->next, b, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        base = b;
+    }
+    return base;
+}
+
+void* base_state_get() {
+    return base_get();
+}
+
+void* base_state_set(void* state) {
+    base_state* old = base;
+    base = static_cast<base_state*>(state);
+    return old;
+}
+
+void base_state_orphan(void* state, int is_orphan) {
+    __atomic_store_n(&static_cast<base_state*>(state)->orphaned, is_orphan, __ATOMIC_RELEASE);
+}
+
+// Fill a freed block with the poison pattern
+static void quarantine_poison(base_allocation a) {
+    memset(reinterpret_cast<void*>(a.first), poison_byte, a.second);
+}
+
+// Check that a quarantined block still holds the poison pattern, word at
+// a time, and report the first modified byte
+static void quarantine_check(base_allocation a) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(a.first);
+    uint64_t pattern = poison_byte * 0x0101010101010101ULL;
+    size_t i = 0;
+    for (; i + 8 <= a.second; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        if (w != pattern) {
+            break;
+        }
+    }
+    for (; i != a.second; ++i) {
+        if (p[i] != poison_byte) {
+            printf("MEMORY BUG: write to freed block %p detected %zu bytes into its %zu bytes\n",
+                   p, i, a.second);
+            return;
+        }
+    }
+}
 
-static unsigned alloc_random() {
-    static uint64_t x = 8973443640547502487ULL;
-    x = x * 6364136223846793005ULL + 1ULL;
-    return x >> 32;
+// Return the whole pages inside a block as [*lo, *hi)
+static void quarantine_pages(base_allocation a, uintptr_t* lo, uintptr_t* hi) {
+    *lo = (a.first + 4095) & ~uintptr_t(4095);
+    *hi = std::max(*lo, (a.first + a.second) & ~uintptr_t(4095));
+}
+
+// Release the oldest quarantined block to the system
+static void quarantine_evict(base_state* b) {
+    quarantine_entry e = b->quarantine[b->quarantine_head];
+    base_allocation a = e.a;
+    ++b->quarantine_head;
+    // drop evicted entries once they are half the vector
+    if (b->quarantine_head * 2 >= b->quarantine.size()) {
+        b->quarantine.erase(b->quarantine.begin(),
+                            b->quarantine.begin() + b->quarantine_head);
+        b->quarantine_head = 0;
+    }
+    b->quarantine_size -= a.second;
+    if (e.mapped) {
+        munmap(reinterpret_cast<void*>(a.first), a.second);
+    } else if (e.sealed) {
+        uintptr_t lo, hi;
+        quarantine_pages(a, &lo, &hi);
+        mprotect(reinterpret_cast<void*>(lo), hi - lo, PROT_READ | PROT_WRITE);
+        free(reinterpret_cast<void*>(a.first));
+    } else {
+        quarantine_check(a);
+        free(reinterpret_cast<void*>(a.first));
+    }
+}
+
+// Add a freed block to the quarantine tail, evicting from the head to
+// stay within `quarantine_max`; the new block itself is never evicted
+static void quarantine_push(base_state* b, base_allocation a, bool mapped,
+                            bool sealed = false) {
+    b->quarantine.push_back({a, mapped, sealed});
+    b->quarantine_size += a.second;
+    while (b->quarantine_size > quarantine_max
+           && b->quarantine.size() - b->quarantine_head > 1) {
+        quarantine_evict(b);
+    }
 }
 
 static void base_allocate_atexit();
 
+static int slab_class(size_t sz) {
+    if (sz > slab_classes[nslab_classes - 1]) {
+        return -1;
+    }
+    return slab_class_of.cls[(sz + 15) / 16];
+}
+
+static void* slab_malloc(base_state* b, int c) {
+    slab_freelist& fl = b->slabs[c];
+    if (fl.count > slab_min_free) {
+        void* ptr = fl.head;
+        fl.head = *reinterpret_cast<void**>(ptr);
+        --fl.count;
+        return ptr;
+    }
+    if (fl.next + slab_classes[c] > fl.end) {
+        // need a new slab, and maybe a new chunk
+        if (b->chunk_next == b->chunk_end) {
+            void* chunk = aligned_alloc(slab_chunk_size, slab_chunk_size);
+            if (!chunk) {
+                return nullptr;
+            }
+            b->slab_chunks.insert(reinterpret_cast<uintptr_t>(chunk));
+            b->chunk_next = reinterpret_cast<char*>(chunk);
+            b->chunk_end = b->chunk_next + slab_chunk_size;
+        }
+        slab_header* slab = reinterpret_cast<slab_header*>(b->chunk_next);
+        b->chunk_next += slab_size;
+        slab->cls = c;
+        fl.next = slab->blocks;
+        fl.end = reinterpret_cast<char*>(slab) + slab_size;
+    }
+    void* ptr = fl.next;
+    fl.next += slab_classes[c];
+    return ptr;
+}
+
+static bool slab_free(base_state* b, void* ptr) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    if (b->slab_chunks.empty()
+        || !b->slab_chunks.count(addr & ~(slab_chunk_size - 1))) {
+        return false;
+    }
+    slab_header* slab = reinterpret_cast<slab_header*>(addr & ~(slab_size - 1));
+    slab_freelist& fl = b->slabs[slab->cls];
+    *reinterpret_cast<void**>(ptr) = nullptr;
+    if (fl.count) {
+        *reinterpret_cast<void**>(fl.tail) = ptr;
+    } else {
+        fl.head = ptr;
+    }
+    fl.tail = ptr;
+    ++fl.count;
+    return true;
+}
+
 void* base_malloc(size_t sz) {
+    // small blocks come from slabs if enabled
+    int c;
+    if (slab_enabled && (c = slab_class(sz)) >= 0) {
+        return slab_malloc(base_get(), c);
+    }
+
     if (disabled) {
         return malloc(sz);
     }
 
     static int base_alloc_atexit_installed = 0;
-    if (!base_alloc_atexit_installed) {
+    if (!__atomic_load_n(&base_alloc_atexit_installed, __ATOMIC_RELAXED)
+        && !__atomic_exchange_n(&base_alloc_atexit_installed, 1, __ATOMIC_RELAXED)) {
         atexit(base_allocate_atexit);
-        base_alloc_atexit_installed = 1;
-    }
-
-    // try to use a previously-freed block 75% of the time
-    unsigned r = alloc_random();
-    if (r % 4 != 0) {
-        for (unsigned ntries = 0; ntries < 10 && ntries < frees.size(); ++ntries) {
-            auto& f = frees[alloc_random() % frees.size()];
-            if (f.second >= sz) {
-                allocs.insert(f);
-                uintptr_t ptr = f.first;
-                f = frees.back();
-                frees.pop_back();
-                return reinterpret_cast<void*>(ptr);
-            }
-        }
     }
 
-    // need a new allocation
+    // freed blocks are reused only after leaving the quarantine
+    base_state* b = base_get();
     void* ptr = malloc(sz ? sz : 1);
     if (ptr) {
-        allocs[reinterpret_cast<uintptr_t>(ptr)] = sz;
+        b->allocs[reinterpret_cast<uintptr_t>(ptr)] = malloc_usable_size(ptr);
+    }
+    return ptr;
+}
+
+void* base_calloc(size_t sz) {
+    if (sz < zero_map_min) {
+        void* ptr = base_malloc(sz);
+        if (ptr) {
+            memset(ptr, 0, sz);
+        }
+        return ptr;
     }
+    void* ptr = mmap(nullptr, sz, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+    base_get()->mapped[reinterpret_cast<uintptr_t>(ptr)] = sz;
     return ptr;
 }
 
+static bool zero_map_free(base_state* b, void* ptr) {
+    if (b->mapped.empty()) {
+        return false;
+    }
+    auto it = b->mapped.find(reinterpret_cast<uintptr_t>(ptr));
+    if (it == b->mapped.end()) {
+        return false;
+    }
+    base_allocation a = *it;
+    b->mapped.erase(it);
+    // keep the range reserved even if it cannot be protected
+    mprotect(ptr, a.second, PROT_NONE);
+    quarantine_push(b, a, true);
+    return true;
+}
+
 void base_free(void* ptr) {
-    if (disabled || !ptr) {
+    if (ptr && (slab_free(base_get(), ptr) || zero_map_free(base_get(), ptr))) {
+        return;
+    } else if (disabled || !ptr) {
         free(ptr);
     } else {
         // mark free if found; if not found, invalid free: silently ignore
-        auto it = allocs.find(reinterpret_cast<uintptr_t>(ptr));
-        if (it != allocs.end()) {
-            frees.push_back(*it);
-            allocs.erase(it);
+        base_state* b = base_get();
+        auto it = b->allocs.find(reinterpret_cast<uintptr_t>(ptr));
+        if (it != b->allocs.end()) {
+            base_allocation a = *it;
+            b->allocs.erase(it);
+            if (a.second > quarantine_max) {
+                uintptr_t lo, hi;
+                quarantine_pages(a, &lo, &hi);
+                mprotect(reinterpret_cast<void*>(lo), hi - lo, PROT_NONE);
+                quarantine_push(b, a, false, true);
+                return;
+            }
+            quarantine_poison(a);
+            quarantine_push(b, a, false);
         }
     }
 }
 
+size_t base_usable_size(void* ptr) {
+    base_state* b = base_get();
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    if (!b->slab_chunks.empty()
+        && b->slab_chunks.count(addr & ~(slab_chunk_size - 1))) {
+        slab_header* slab = reinterpret_cast<slab_header*>(addr & ~(slab_size - 1));
+        return slab_classes[slab->cls];
+    }
+    if (!b->mapped.empty()) {
+        auto it = b->mapped.find(addr);
+        if (it != b->mapped.end()) {
+            return (it->second + 4095) & ~size_t(4095);
+        }
+    }
+    auto it = b->allocs.find(addr);
+    if (it != b->allocs.end()) {
+        return it->second;
+    }
+    return malloc_usable_size(ptr);
+}
+
 void base_allocate_disable(int d) {
     disabled = d;
 }
 
+void base_allocate_slab(int enabled) {
+    slab_enabled = enabled;
+}
+
 static void base_allocate_atexit() {
-    // clean up freed memory to shut up leak detector
-    for (auto& alloc : frees) {
-        free(reinterpret_cast<void*>(alloc.first));
+    // clean up freed memory to shut up leak detector, checking the poison
+    for (base_state* b = __atomic_load_n(&base_states, __ATOMIC_ACQUIRE); b; b = b->next) {
+        if (b == base || __atomic_load_n(&b->orphaned, __ATOMIC_ACQUIRE)) {
+            while (b->quarantine_head != b->quarantine.size()) {
+                quarantine_evict(b);
+            }
+        }
     }
 }
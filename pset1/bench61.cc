@@ -0,0 +1,188 @@
+#include "m61.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+// bench61: Time the m61 allocator's hot paths against the system
+// allocator. Measures malloc/free pairs across sizes and live-set sizes,
+// calloc throughput, and leak report latency. Prints one JSON object per
+// measurement, like io61_profile_end, so results can be compared across
+// builds to catch regressions. By default m61 runs on the base allocator,
+// as in the tests; each object names the backend that served its blocks.
+
+// Parenthesized names call the system allocator, not the m61 macros.
+static void* system_malloc(size_t sz, const char*, long) {
+    return (malloc)(sz);
+}
+static void system_free(void* ptr, const char*, long) {
+    (free)(ptr);
+}
+static void* system_calloc(size_t nmemb, size_t sz, const char*, long) {
+    return (calloc)(nmemb, sz);
+}
+
+struct allocator {
+    const char* name;
+    bool is_m61;
+    void* (*alloc)(size_t, const char*, long);
+    void (*release)(void*, const char*, long);
+    void* (*zalloc)(size_t, size_t, const char*, long);
+};
+
+static const allocator allocators[] = {
+    {"m61", true, m61_malloc, m61_free, m61_calloc},
+    {"system", false, system_malloc, system_free, system_calloc}
+};
+
+static const size_t sizes[] = {16, 128, 1024, 8192};
+static const size_t live_sizes[] = {1, 1024, 32768};
+static const size_t calloc_sizes[] = {64, 4096, 1 << 20};
+static const size_t max_live_bytes = 64 << 20;
+
+static unsigned long noperations = 1000000;
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// bench_malloc_free(a, sz, nlive)
+///    Keep `nlive` blocks of `sz` bytes allocated while replacing one
+///    `noperations` times; return nanoseconds per malloc/free pair.
+static double bench_malloc_free(const allocator& a, size_t sz, size_t nlive) {
+    void** live = new void*[nlive];
+    for (size_t i = 0; i != nlive; ++i) {
+        live[i] = a.alloc(sz, __FILE__, __LINE__);
+    }
+    double start = now();
+    for (unsigned long i = 0; i != noperations; ++i) {
+        size_t pos = (i * 7919) % nlive;
+        a.release(live[pos], __FILE__, __LINE__);
+        live[pos] = a.alloc(sz, __FILE__, __LINE__);
+        assert(live[pos]);
+    }
+    double elapsed = now() - start;
+    for (size_t i = 0; i != nlive; ++i) {
+        a.release(live[i], __FILE__, __LINE__);
+    }
+    delete[] live;
+    return elapsed / noperations * 1e9;
+}
+
+/// bench_calloc(a, sz)
+///    Allocate and free `sz` zeroed bytes repeatedly, touching each block
+///    once; return throughput in MB/s.
+static double bench_calloc(const allocator& a, size_t sz) {
+    unsigned long n = noperations / (1 + sz / 1024);
+    double start = now();
+    for (unsigned long i = 0; i != n; ++i) {
+        char* p = (char*) a.zalloc(1, sz, __FILE__, __LINE__);
+        assert(p && p[sz - 1] == 0);
+        p[0] = 1;
+        a.release(p, __FILE__, __LINE__);
+    }
+    double elapsed = now() - start;
+    return (double) n * sz / elapsed / 1e6;
+}
+
+/// bench_leak_report(nlive)
+///    Return the seconds m61_printleakreport takes with `nlive` active
+///    allocations; the report itself goes to /dev/null.
+static double bench_leak_report(size_t nlive) {
+    void** live = new void*[nlive];
+    for (size_t i = 0; i != nlive; ++i) {
+        live[i] = m61_malloc(32, __FILE__, __LINE__);
+    }
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    double start = now();
+    m61_printleakreport();
+    fflush(stdout);
+    double elapsed = now() - start;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    for (size_t i = 0; i != nlive; ++i) {
+        m61_free(live[i], __FILE__, __LINE__);
+    }
+    delete[] live;
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    bool use_system = false;
+    bool use_slab = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:sp")) != -1) {
+        switch (opt) {
+        case 'n': {
+            char* end;
+            noperations = strtoul(optarg, &end, 0);
+            if (*end == 'm' || *end == 'M') {
+                noperations *= 1000000;
+            }
+            break;
+        }
+        case 's':
+            use_system = true;
+            break;
+        case 'p':
+            use_slab = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n NOPS] [-s] [-p]\n\
+  Default NOPS=%lu operations per measurement\n\
+  -s  m61 uses the system allocator (default is the base allocator)\n\
+  -p  serve small blocks from the base allocator's size-class slabs\n",
+                    argv[0], noperations);
+            exit(1);
+        }
+    }
+    assert(noperations > 0);
+
+    base_allocate_disable(use_system);
+    base_allocate_slab(use_slab);
+    // slabs serve small blocks even on top of the system allocator
+    const char* m61_backend = use_system
+        ? (use_slab ? "system+slab" : "system")
+        : (use_slab ? "base+slab" : "base");
+
+    for (auto& a : allocators) {
+        for (size_t sz : sizes) {
+            for (size_t nlive : live_sizes) {
+                if (sz * nlive > max_live_bytes) {
+                    continue;
+                }
+                double ns = bench_malloc_free(a, sz, nlive);
+                printf("{\"bench\":\"malloc_free\", \"allocator\":\"%s\", \"backend\":\"%s\", \"size\":%zu, \"live\":%zu, \"ns_per_op\":%.1f}\n",
+                       a.name, a.is_m61 ? m61_backend : "system", sz, nlive, ns);
+                fflush(stdout);
+            }
+        }
+    }
+    for (auto& a : allocators) {
+        for (size_t sz : calloc_sizes) {
+            double mbps = bench_calloc(a, sz);
+            printf("{\"bench\":\"calloc\", \"allocator\":\"%s\", \"backend\":\"%s\", \"size\":%zu, \"mb_per_s\":%.0f}\n",
+                   a.name, a.is_m61 ? m61_backend : "system", sz, mbps);
+            fflush(stdout);
+        }
+    }
+    for (size_t nlive : live_sizes) {
+        double sec = bench_leak_report(nlive);
+        printf("{\"bench\":\"leak_report\", \"allocator\":\"m61\", \"backend\":\"%s\", \"live\":%zu, \"ms\":%.3f}\n",
+               m61_backend, nlive, sec * 1e3);
+        fflush(stdout);
+    }
+
+    m61_statistics stats;
+    m61_getstatistics(&stats);
+    assert(stats.nactive == 0);
+}
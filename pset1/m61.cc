@@ -5,207 +5,1404 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include <vector>
 #include <algorithm>
-
-/// Global stats struct to hold running statistics totals
-m61_statistics gstats = {0, 0, 0, 0, 0, 0, 0, 0};
+#include <type_traits>
+#include <math.h>
+#include <mutex>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 
 /// Unique identifiers for metadata and trailing data
-size_t id = 1006199731171040;
 char idc = 'Z';
 int unfreed_id = 12345;
 
-/// Global pointer to start of alloc linked list
-metadata base_meta = {0,0,0,nullptr,0,nullptr,nullptr};
+/// hh_sketch
+///   Heavy hitter sketch (Space-Saving). `counters` holds the monitored
+///   call sites; `slots` is an open-addressed hash table mapping a call
+///   site to 1 + its counter index (0 means empty). Memory use is fixed.
+///   Only the `hh_nhists` largest counters get histograms, which live in
+///   the shard; `hist_of` and `hist_site` link counters and histograms.
+constexpr int hh_ncounters = 64;
+constexpr int hh_nslots = 128;
+constexpr int hh_nhists = 8;
+struct hh_sketch {
+    hhcounter counters[hh_ncounters];
+    int nused;
+    unsigned char slots[hh_nslots];
+    unsigned char hist_of[hh_ncounters];    // 1 + histogram index, or 0
+    unsigned char hist_site[hh_nhists];     // 1 + counter index, or 0
+};
+
+/// hh_hist
+///   Histograms of one call site
+struct hh_hist {
+    const char* file;
+    long line;
+    unsigned long long size_hist[m61_nbuckets];
+    unsigned long long lifetime_hist[m61_nbuckets];
+};
+
+/// guard_map
+///   A guard-page mapping: data pages followed by one PROT_NONE page
+struct guard_map {
+    char* base;
+    size_t length;                // including the guard page
+};
+constexpr unsigned guard_quarantine_size = 256;
+constexpr unsigned guard_recycle_size = 64;
+
+/// m61_shard
+///   Per-thread allocator state. Each thread updates only its own shard, so
+///   the hot path shares no cache lines with other threads; readers such as
+///   m61_getstatistics merge all shards on demand. Shards are never freed,
+///   so their statistics outlive the thread. When a thread exits, its shard
+///   becomes an orphan: threads freeing its blocks release them on its
+///   behalf, and the next new thread takes it over.
+struct m61_shard {
+    m61_statistics stats;         // heap_min/heap_max unused; see below
+    hh_sketch hh;
+    hh_hist hists[hh_nhists];     // histograms of the largest sites
+    metadata* returns;            // blocks freed by other threads
+    m61_shard* next;              // next shard in `shards` list
+    void* base;                   // base allocator state of its blocks
+    int orphan;                   // 0 live, 1 orphaned, 2 orphan being drained
+    size_t slot_next;             // next unused side-table slot
+    size_t slot_end;              // end of this shard's side-table page
+    std::vector<uint32_t, system_allocator<uint32_t>> free_slots;
+    unsigned guard_countdown;     // allocations until the next guarded one
+    guard_map quarantine[guard_quarantine_size];  // FIFO of retired mappings
+    unsigned quarantine_next;     // oldest quarantine entry
+    guard_map recycled[guard_recycle_size];       // single-page mappings to reuse
+    unsigned nrecycled;
+    long long prof_countdown;     // bytes until the next profile sample
+    uint64_t prof_random;         // random state for sample intervals
+    bool prof_started;            // first sample interval drawn
+    m61_export_slot* export_slot; // exported statistics, if any
+    std::vector<char*, system_allocator<char*>> scope_blocks;  // see m61_scope_end
+    std::vector<size_t, system_allocator<size_t>> scope_marks; // start of each scope
+    size_t scope_compact_at;      // scope_blocks size that triggers compaction
+};
+
+/// List of all shards, and the current thread's shard
+static m61_shard* shards;
+static thread_local m61_shard* my_shard;
+
+/// Thread exit hook; its destructor orphans the thread's shard
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static void shard_exit(void* shard);
+
+/// adopt_orphan()
+///   Take over the shard of an exited thread, with its base allocator
+///   state, for the calling thread. Returns nullptr if there is none.
+static m61_shard* adopt_orphan() {
+    for (m61_shard* s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+        int idle = 1;
+        if (__atomic_load_n(&s->orphan, __ATOMIC_RELAXED) == 1
+            && __atomic_compare_exchange_n(&s->orphan, &idle, 0, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            base_state_set(s->base);
+            base_state_orphan(s->base, 0);
+            s->prof_countdown = 0;
+            s->prof_started = false;
+            return s;
+        }
+    }
+    return nullptr;
+}
 
-/// Vector for creating heavy hitters report
-hh_vec hhvec;
+/// Heap bounds, shared by all threads; only widened
+static char* heap_min;
+static char* heap_max;
 
-/// overflowed(a, b)
-///   Helper function to check for multiplication overflow
-bool overflowed(size_t a, size_t b){
-  size_t prod = a * b;
-  return (prod / a != b);
+/// current_shard()
+///   Return the calling thread's shard, creating it on first use
+static m61_shard* current_shard() {
+    if (!my_shard) {
+        m61_shard* s = adopt_orphan();
+        if (!s) {
+            s = new (system_allocator<m61_shard>().allocate(1)) m61_shard();
+            s->base = base_state_get();
+            s->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&shards, &s->next, s, true,
+                                                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            }
+        }
+        pthread_once(&shard_key_once, [] () { pthread_key_create(&shard_key, shard_exit); });
+        pthread_setspecific(shard_key, s);
+        my_shard = s;
+    }
+    return my_shard;
 }
 
-/// was_freed(ptr)
-///   Helper function to determine if a pointer has been freed
-bool was_freed(metadata* ptr){
-  return (ptr->unfreed != unfreed_id);
+/// stat_add(field, delta)
+///   Add `delta` to a statistics field of the current thread's shard.
+///   Only the owning thread writes a shard, so a relaxed load and store
+///   suffice; other threads may read the field at any time.
+static inline void stat_add(unsigned long long& field, unsigned long long delta) {
+    __atomic_store_n(&field, __atomic_load_n(&field, __ATOMIC_RELAXED) + delta,
+                     __ATOMIC_RELAXED);
 }
 
-/// inrange(ptr, mptr)
-///   Helper function to decide if a pointer points within an allocation
-///   ptr --> pointer to check
-///   mptr --> pointer to allocated metadata
-bool inrange(void* ptr, metadata* mptr){
-  void* endptr = (char*) mptr + sizeof(metadata) + mptr->size;
-  return(ptr >= mptr && ptr <= endptr);
-  }
+/// stat_add_sat(field, delta)
+///   Like stat_add, but stick at the largest value instead of wrapping.
+///   Used for `fail_size`, where one failed request can be almost
+///   SIZE_MAX bytes.
+static inline void stat_add_sat(unsigned long long& field, unsigned long long delta) {
+    unsigned long long sum;
+    if (__builtin_add_overflow(__atomic_load_n(&field, __ATOMIC_RELAXED), delta, &sum)) {
+        sum = ~0ULL;
+    }
+    __atomic_store_n(&field, sum, __ATOMIC_RELAXED);
+}
+
+/// Exported statistics
+///   Once m61_export_statistics has mapped a segment, every change to a
+///   shard's statistics is also copied into the shard's slot there. Only
+///   the owning thread writes a slot, so its seqlock needs no atomic
+///   read-modify-write; everything is a relaxed store between fences.
+///   Threads beyond the segment's capacity are counted in `nslots` but not
+///   exported: they get `export_full`, a marker slot never written.
+///   Threads that already exist when export starts get their slots then,
+///   so idle threads show up too.
 
-/// line_before(h1, h2)
-///   Comparison helper function for vector sorting by line number
-bool line_before(hhstruct h1, hhstruct h2) {
-  return (h1.file_line < h2.file_line);
+static m61_export_segment* export_seg;
+static m61_export_slot export_full;
+static char export_name[256];
+
+/// hist_bucket(x)
+///   Return the m61 histogram bucket for value `x`
+static inline int hist_bucket(unsigned long long x) {
+    return x ? std::min(64 - __builtin_clzll(x), m61_nbuckets - 1) : 0;
 }
 
-/// size_bigger(h1, h2)
-///   Comparison helper function for vector sorting by alloc size
-bool size_bigger(hhstruct h1, hhstruct h2) {
-  return (h1.size > h2.size);
+/// export_claim(seg)
+///   Return a free slot of `seg`, or `export_full` if none is left
+static m61_export_slot* export_claim(m61_export_segment* seg) {
+    unsigned i = __atomic_fetch_add(&seg->nslots, 1, __ATOMIC_RELAXED);
+    return i < m61_export_nslots ? &seg->slots[i] : &export_full;
 }
 
-/// m61_malloc(sz, file, line)
-///    Return a pointer to `sz` bytes of newly-allocated dynamic memory.
-///    The memory is not initialized. If `sz == 0`, then m61_malloc must
-///    return a unique, newly-allocated pointer value. The allocation
-///    request was at location `file`:`line`.
+/// export_copy(slot, shard, lo, hi)
+///   Copy the shard's totals to `slot`, with buckets [lo, hi) of its size
+///   histogram. The caller holds the seqlock.
+static void export_copy(m61_export_slot* slot, m61_shard* shard, int lo, int hi) {
+    const m61_statistics& st = shard->stats;
+    __atomic_store_n(&slot->nactive, __atomic_load_n(&st.nactive, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->active_size, __atomic_load_n(&st.active_size, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->ntotal, __atomic_load_n(&st.ntotal, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->total_size, __atomic_load_n(&st.total_size, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->nfail, __atomic_load_n(&st.nfail, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->fail_size, __atomic_load_n(&st.fail_size, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    for (int b = lo; b < hi; ++b) {
+        __atomic_store_n(&slot->size_hist[b], __atomic_load_n(&st.size_hist[b], __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+    }
+}
+
+/// export_update(shard, sz)
+///   Copy the shard's statistics to its exported slot. If `sz >= 0`, an
+///   allocation of `sz` bytes was just counted, so also copy its bucket of
+///   the shard's size histogram. The owner's first update copies the
+///   whole histogram, which may have changed since export started.
+static void export_update(m61_shard* shard, long long sz) {
+    m61_export_slot* slot = shard->export_slot;
+    if (!slot) {
+        slot = shard->export_slot = export_claim(export_seg);
+    }
+    if (slot == &export_full) {
+        return;
+    }
+    unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (seq == 0) {
+        export_copy(slot, shard, 0, m61_nbuckets);
+    } else {
+        int b = sz >= 0 ? hist_bucket(sz) : 0;
+        export_copy(slot, shard, b, sz >= 0 ? b + 1 : 0);
+    }
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/// export_changed(shard, sz)
+///   Hot-path hook: publish the shard's statistics if exporting
+static inline void export_changed(m61_shard* shard, long long sz) {
+    if (__atomic_load_n(&export_seg, __ATOMIC_ACQUIRE)) {
+        export_update(shard, sz);
+    }
+}
+
+/// heap_extend(lo, hi)
+///   Widen the shared heap bounds to include [lo, hi]
+static void heap_extend(char* lo, char* hi) {
+    char* cur = __atomic_load_n(&heap_min, __ATOMIC_RELAXED);
+    while ((!cur || lo < cur)
+           && !__atomic_compare_exchange_n(&heap_min, &cur, lo, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    cur = __atomic_load_n(&heap_max, __ATOMIC_RELAXED);
+    while (hi > cur
+           && !__atomic_compare_exchange_n(&heap_max, &cur, hi, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    if (m61_export_segment* seg = __atomic_load_n(&export_seg, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&seg->heap_min, (uintptr_t) __atomic_load_n(&heap_min, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&seg->heap_max, (uintptr_t) __atomic_load_n(&heap_max, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+    }
+}
+
+/// Active allocation index
+///   A radix tree over the address space with one bit per 8-byte granule.
+///   Bit `(addr >> 3)` is set iff `addr` is the payload address of an active
+///   allocation, so insert, erase and exact lookup are O(1) bit operations.
+///   Each leaf and interior node also keeps a bitmap hinting which of its
+///   children are nonempty, so finding the closest allocation at or below
+///   an address scans a bounded number of words regardless of how many
+///   blocks are live. Nodes are carved from memory mapped directly from the
+///   kernel, never from the heap, so wild writes to neighbouring blocks
+///   cannot reach them; they are never freed.
+///
+///   All bits are updated with atomic instructions, so threads lock the
+///   index only to install a missing node. A hint bit is always set when
+///   its child is nonempty; it may briefly stay set after the child
+///   empties, which searches tolerate.
+
+constexpr int idx_granule_shift = 3;     // 8-byte granules
+constexpr int idx_leaf_shift = 16;       // each leaf covers 64KB of addresses
+constexpr int idx_node_shift = 10;       // 1024 children per interior node
+constexpr int idx_root_shift = 12;       // 4096 children at the root
+constexpr int idx_addr_bits = idx_leaf_shift + 2 * idx_node_shift + idx_root_shift;
+constexpr size_t idx_leaf_words = (size_t) 1 << (idx_leaf_shift - idx_granule_shift - 6);
+
+struct idx_leaf {
+    uint64_t summary[idx_leaf_words / 64];   // bit i hints words[i] != 0
+    uint64_t words[idx_leaf_words];          // one bit per granule
+};
+
+template <typename T, int shift>
+struct idx_node {
+    static constexpr size_t nwords = ((size_t) 1 << shift) / 64;
+    uint64_t nonempty[nwords];               // bit i hints child[i] nonempty
+    T* child[(size_t) 1 << shift];
+};
+
+typedef idx_node<idx_leaf, idx_node_shift> idx_lower;
+typedef idx_node<idx_lower, idx_node_shift> idx_upper;
+static idx_node<idx_upper, idx_root_shift> idx_root;
+
+/// idx_slot(addr, level_shift, width)
+///   Helper function to extract one level's child index from `addr`
+static inline size_t idx_slot(uintptr_t addr, int level_shift, int width) {
+    return (addr >> level_shift) & (((uintptr_t) 1 << width) - 1);
+}
+
+/// meta_pages(sz)
+///   Return `sz` bytes of zeroed memory for allocator bookkeeping, mapped
+///   apart from any heap block, or nullptr on failure
+static void* meta_pages(size_t sz) {
+    void* m = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return m == MAP_FAILED ? nullptr : m;
+}
+
+/// idx_node_alloc(sz)
+///   Return `sz` bytes of zeroed memory for an index node, or nullptr on
+///   failure. Nodes are carved from large mappings, so a scattered heap
+///   costs one mapping per `idx_chunk_size` bytes of nodes rather than one
+///   per node. The caller holds `idx_lock`.
+constexpr size_t idx_chunk_size = (size_t) 1 << 20;
+static std::mutex idx_lock;
+static char* idx_chunk_next;
+static char* idx_chunk_end;
+
+static void* idx_node_alloc(size_t sz) {
+    sz = (sz + 63) & ~(size_t) 63;
+    if ((size_t) (idx_chunk_end - idx_chunk_next) < sz) {
+        char* chunk = (char*) meta_pages(idx_chunk_size);
+        if (!chunk) {
+            return nullptr;
+        }
+        idx_chunk_next = chunk;
+        idx_chunk_end = chunk + idx_chunk_size;
+    }
+    void* m = idx_chunk_next;
+    idx_chunk_next += sz;
+    return m;
+}
+
+/// idx_child(node, i, create)
+///   Return child `i` of `node`. If it is missing and `create` is true,
+///   install a zeroed one. Returns nullptr if the child is missing and
+///   could not be created.
+template <typename T, int shift>
+static T* idx_child(idx_node<T, shift>* node, size_t i, bool create) {
+    T* c = __atomic_load_n(&node->child[i], __ATOMIC_ACQUIRE);
+    if (!c && create) {
+        std::lock_guard<std::mutex> guard(idx_lock);
+        c = __atomic_load_n(&node->child[i], __ATOMIC_ACQUIRE);
+        if (!c) {
+            c = (T*) idx_node_alloc(sizeof(T));
+            if (c) {
+                __atomic_store_n(&node->child[i], c, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    return c;
+}
+
+/// bits_word(bits, w)
+///   Atomically load word `w` of a bitmap
+static inline uint64_t bits_word(const uint64_t* bits, size_t w) {
+    return __atomic_load_n(&bits[w], __ATOMIC_SEQ_CST);
+}
+
+/// bits_test(bits, i)
+///   Return bit `i` of a bitmap
+static inline bool bits_test(const uint64_t* bits, size_t i) {
+    return (bits_word(bits, i / 64) >> (i % 64)) & 1;
+}
+
+/// bits_last(bits, i)
+///   Return the largest set bit index `<= i` in `bits`, or -1 if none
+static long bits_last(const uint64_t* bits, long i) {
+    if (i < 0) {
+        return -1;
+    }
+    long w = i / 64;
+    uint64_t word = bits_word(bits, w) & (~(uint64_t) 0 >> (63 - i % 64));
+    while (word == 0) {
+        if (--w < 0) {
+            return -1;
+        }
+        word = bits_word(bits, w);
+    }
+    return w * 64 + 63 - __builtin_clzll(word);
+}
+
+/// bits_next(bits, i, n)
+///   Return the smallest set bit index in `[i, n)` in `bits`, or -1 if none
+static long bits_next(const uint64_t* bits, long i, long n) {
+    if (i >= n) {
+        return -1;
+    }
+    long w = i / 64;
+    uint64_t word = bits_word(bits, w) & (~(uint64_t) 0 << (i % 64));
+    while (word == 0) {
+        if (++w >= n / 64) {
+            return -1;
+        }
+        word = bits_word(bits, w);
+    }
+    return w * 64 + __builtin_ctzll(word);
+}
+
+/// idx_hint
+///   One level of hint bits on the path to an address: `nwords` words at
+///   `object` are summarized by bit `bit` of `parent`.
+struct idx_hint {
+    uint64_t* object;
+    size_t nwords;
+    uint64_t* parent;
+    size_t bit;
+};
+
+/// idx_walk(addr, create, hints)
+///   Return the leaf covering `addr` (or nullptr if it does not exist and
+///   `create` is false), and fill in `hints` from the leaf word upward.
+static idx_leaf* idx_walk(uintptr_t addr, bool create, idx_hint hints[4]) {
+    if (addr >> idx_addr_bits) {
+        return nullptr;
+    }
+    size_t ri = idx_slot(addr, idx_leaf_shift + 2 * idx_node_shift, idx_root_shift);
+    size_t ui = idx_slot(addr, idx_leaf_shift + idx_node_shift, idx_node_shift);
+    size_t li = idx_slot(addr, idx_leaf_shift, idx_node_shift);
+    size_t w = idx_slot(addr, idx_granule_shift, idx_leaf_shift - idx_granule_shift) / 64;
+    idx_upper* u = idx_child(&idx_root, ri, create);
+    idx_lower* l = u ? idx_child(u, ui, create) : nullptr;
+    idx_leaf* leaf = l ? idx_child(l, li, create) : nullptr;
+    if (leaf) {
+        hints[0] = {&leaf->words[w], 1, leaf->summary, w};
+        hints[1] = {leaf->summary, idx_leaf_words / 64, l->nonempty, li};
+        hints[2] = {l->nonempty, idx_lower::nwords, u->nonempty, ui};
+        hints[3] = {u->nonempty, idx_upper::nwords, idx_root.nonempty, ri};
+    }
+    return leaf;
+}
+
+/// idx_hint_empty(h)
+///   Return true iff every word summarized by `h` is zero
+static bool idx_hint_empty(const idx_hint& h) {
+    for (size_t i = 0; i != h.nwords; ++i) {
+        if (bits_word(h.object, i) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// index_insert(ptr)
+///   Record `ptr` as the payload address of an active allocation. Returns
+///   false if memory for the index ran out.
+static bool index_insert(void* ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+    idx_hint hints[4];
+    idx_leaf* leaf = idx_walk(addr, true, hints);
+    if (!leaf) {
+        return false;
+    }
+    size_t g = idx_slot(addr, idx_granule_shift, idx_leaf_shift - idx_granule_shift);
+    __atomic_fetch_or(&leaf->words[g / 64], (uint64_t) 1 << (g % 64), __ATOMIC_SEQ_CST);
+    // Set hint bits upward, stopping at the first one already set
+    for (int k = 0; k != 4; ++k) {
+        uint64_t mask = (uint64_t) 1 << (hints[k].bit % 64);
+        uint64_t* pw = &hints[k].parent[hints[k].bit / 64];
+        if (__atomic_load_n(pw, __ATOMIC_SEQ_CST) & mask) {
+            break;
+        }
+        __atomic_fetch_or(pw, mask, __ATOMIC_SEQ_CST);
+    }
+    return true;
+}
+
+/// index_contains(ptr)
+///   Return true iff `ptr` is the payload address of an active allocation
+static bool index_contains(void* ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+    idx_hint hints[4];
+    idx_leaf* leaf = idx_walk(addr, false, hints);
+    return leaf
+        && bits_test(leaf->words, idx_slot(addr, idx_granule_shift, idx_leaf_shift - idx_granule_shift));
+}
+
+/// index_erase(ptr)
+///   Remove `ptr` from the index. Returns false if it was not present.
+static bool index_erase(void* ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+    idx_hint hints[4];
+    idx_leaf* leaf = idx_walk(addr, false, hints);
+    size_t g = idx_slot(addr, idx_granule_shift, idx_leaf_shift - idx_granule_shift);
+    uint64_t gmask = (uint64_t) 1 << (g % 64);
+    if (!(__atomic_fetch_and(&leaf->words[g / 64], ~gmask, __ATOMIC_SEQ_CST) & gmask)) {
+        return false;
+    }
+    // Clear hint bits upward while their objects are empty. After clearing
+    // a hint, recheck its object: a concurrent insert may have seen the
+    // hint still set and skipped setting it.
+    for (int k = 0; k != 4 && idx_hint_empty(hints[k]); ++k) {
+        uint64_t mask = (uint64_t) 1 << (hints[k].bit % 64);
+        uint64_t* pw = &hints[k].parent[hints[k].bit / 64];
+        __atomic_fetch_and(pw, ~mask, __ATOMIC_SEQ_CST);
+        if (!idx_hint_empty(hints[k])) {
+            __atomic_fetch_or(pw, mask, __ATOMIC_SEQ_CST);
+            break;
+        }
+    }
+    return true;
+}
+
+/// idx_floor_in(node, base, addr)
+///   Return the largest active payload address `<= addr` stored in `node`,
+///   which covers addresses starting at `base`, or 0 if none. Hint bits
+///   that turn out stale just move the search to the next candidate.
+static uintptr_t idx_floor_in(idx_leaf* leaf, uintptr_t base, uintptr_t addr) {
+    long g = ((long) 1 << (idx_leaf_shift - idx_granule_shift)) - 1;
+    if (addr < base + ((uintptr_t) 1 << idx_leaf_shift)) {
+        g = (addr - base) >> idx_granule_shift;
+    }
+    uint64_t word = bits_word(leaf->words, g / 64) & (~(uint64_t) 0 >> (63 - g % 64));
+    for (long w = g / 64; word == 0; word = bits_word(leaf->words, w)) {
+        w = bits_last(leaf->summary, w - 1);
+        if (w < 0) {
+            return 0;
+        }
+        g = w * 64;
+    }
+    g = (g / 64) * 64 + 63 - __builtin_clzll(word);
+    return base + ((uintptr_t) g << idx_granule_shift);
+}
+template <typename T, int shift>
+static uintptr_t idx_floor_in(idx_node<T, shift>* node, uintptr_t base, uintptr_t addr) {
+    constexpr int child_shift = std::is_same<T, idx_leaf>::value ? idx_leaf_shift
+        : std::is_same<T, idx_lower>::value ? idx_leaf_shift + idx_node_shift
+        : idx_leaf_shift + 2 * idx_node_shift;
+    long i = ((long) 1 << shift) - 1;
+    if (addr < base + ((uintptr_t) 1 << (child_shift + shift))) {
+        i = (addr - base) >> child_shift;
+    }
+    for (; (i = bits_last(node->nonempty, i)) >= 0; --i) {
+        if (T* c = idx_child(node, i, false)) {
+            if (uintptr_t r = idx_floor_in(c, base + ((uintptr_t) i << child_shift), addr)) {
+                return r;
+            }
+        }
+    }
+    return 0;
+}
+
+/// index_floor(ptr)
+///   Return the largest active payload address `<= ptr`, or 0 if none.
+static uintptr_t index_floor(void* ptr) {
+    return idx_floor_in(&idx_root, 0, (uintptr_t) ptr);
+}
+
+/// index_for_each(fn)
+///   Call `fn(addr)` for every active payload address, in address order
+template <typename F>
+static void index_for_each(F fn) {
+    constexpr long nroot = (long) 1 << idx_root_shift, nnode = (long) 1 << idx_node_shift;
+    for (long ri = 0; (ri = bits_next(idx_root.nonempty, ri, nroot)) >= 0; ++ri) {
+        idx_upper* u = idx_child(&idx_root, ri, false);
+        for (long ui = 0; u && (ui = bits_next(u->nonempty, ui, nnode)) >= 0; ++ui) {
+            idx_lower* l = idx_child(u, ui, false);
+            for (long li = 0; l && (li = bits_next(l->nonempty, li, nnode)) >= 0; ++li) {
+                idx_leaf* leaf = idx_child(l, li, false);
+                uintptr_t base = ((uintptr_t) ri << (idx_leaf_shift + 2 * idx_node_shift))
+                    + ((uintptr_t) ui << (idx_leaf_shift + idx_node_shift))
+                    + ((uintptr_t) li << idx_leaf_shift);
+                for (size_t w = 0; leaf && w != idx_leaf_words; ++w) {
+                    for (uint64_t word = bits_word(leaf->words, w); word; word &= word - 1) {
+                        size_t g = w * 64 + __builtin_ctzll(word);
+                        fn(base + (g << idx_granule_shift));
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Out-of-line metadata
+///   In out-of-line mode, metadata lives in a densely packed side table
+///   instead of in front of each payload, so small payloads share cache
+///   lines only with each other. Each block starts with a guard word holding
+///   its slot number scrambled by `side_magic`; an underflow that clobbers
+///   the guard is reported at free time instead of silently corrupting the
+///   metadata. The table is a directory of fixed-size pages that are never
+///   moved or freed. Each shard claims whole pages and reuses its own slots.
+
+struct side_entry {
+    metadata meta;
+    char* payload;                // payload address, or nullptr if free
+};
+
+constexpr size_t side_page_slots = 4096;
+constexpr size_t side_max_pages = 1 << 16;
+constexpr uint64_t side_magic = 0x6d36315f67756172ULL;
+static side_entry* side_pages[side_max_pages];
+static size_t side_npages;
+static bool meta_outofline;
+
+/// side_entry_at(slot)
+///   Return side-table entry `slot`, or nullptr if no such entry exists
+static inline side_entry* side_entry_at(uint64_t slot) {
+    if (slot >= side_max_pages * side_page_slots) {
+        return nullptr;
+    }
+    side_entry* page = __atomic_load_n(&side_pages[slot / side_page_slots], __ATOMIC_ACQUIRE);
+    return page ? &page[slot % side_page_slots] : nullptr;
+}
+
+/// side_alloc(shard)
+///   Return an unused side-table slot for `shard`, or -1 if none is left
+static long side_alloc(m61_shard* shard) {
+    if (!shard->free_slots.empty()) {
+        long slot = shard->free_slots.back();
+        shard->free_slots.pop_back();
+        return slot;
+    }
+    if (shard->slot_next == shard->slot_end) {
+        size_t page = __atomic_fetch_add(&side_npages, 1, __ATOMIC_RELAXED);
+        side_entry* entries = nullptr;
+        if (page < side_max_pages) {
+            entries = (side_entry*) meta_pages(sizeof(side_entry) * side_page_slots);
+        }
+        if (!entries) {
+            return -1;
+        }
+        __atomic_store_n(&side_pages[page], entries, __ATOMIC_RELEASE);
+        shard->slot_next = page * side_page_slots;
+        shard->slot_end = shard->slot_next + side_page_slots;
+    }
+    return shard->slot_next++;
+}
+
+/// side_claim(shard, payload)
+///   Describe the block at `payload` with a new side-table slot, and write
+///   its guard word. Returns the slot's metadata, or nullptr on failure.
+static metadata* side_claim(m61_shard* shard, char* payload) {
+    long slot = side_alloc(shard);
+    if (slot < 0) {
+        return nullptr;
+    }
+    side_entry* e = side_entry_at(slot);
+    *((uint64_t*) payload - 1) = slot ^ side_magic;
+    e->payload = payload;
+    return &e->meta;
+}
+
+/// meta_of(addr)
+///   Return the metadata of the active allocation at `addr`. In out-of-line
+///   mode, returns nullptr if the guard word before `addr` was overwritten.
+static inline metadata* meta_of(uintptr_t addr) {
+    if (!meta_outofline) {
+        return (metadata*) addr - 1;
+    }
+    side_entry* e = side_entry_at(((uint64_t*) addr)[-1] ^ side_magic);
+    if (!e || e->payload != (char*) addr) {
+        return nullptr;
+    }
+    return &e->meta;
+}
+
+/// payload_of(meta)
+///   Return the payload address described by `meta`
+static inline char* payload_of(metadata* meta) {
+    if (!meta_outofline) {
+        return (char*) (meta + 1);
+    }
+    return ((side_entry*) meta)->payload;
+}
+
+/// Guard pages
+///   In guard-page mode, 1 in `guard_rate` allocations gets its own mapping
+///   with the payload (plus trailing byte, rounded up to the payload's
+///   alignment) ending exactly at an inaccessible page, so a write past the
+///   end faults on the spot. Requests aligned to more than a page are never
+///   guarded.
+///   Freed mappings are made inaccessible too and wait in a per-shard FIFO
+///   quarantine, which catches use after free; mappings leaving quarantine
+///   are unmapped, except that a few single-page ones are kept for reuse to
+///   save system calls.
+
+static unsigned guard_rate;
+
+/// guard_page_size()
+///   Return the system page size
+static size_t guard_page_size() {
+    static size_t page_size;
+    if (!page_size) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    return page_size;
+}
+
+/// guard_tail(sz, align)
+///   Return the bytes between a payload of `sz` bytes and its guard page.
+///   The payload is aligned to `align`, or to the default alignment if
+///   `align` is 0.
+static inline size_t guard_tail(size_t sz, size_t align) {
+    if (!align) {
+        align = meta_outofline ? 8 : 16;
+    }
+    return (sz + 1 + align - 1) & ~(align - 1);
+}
+
+/// guard_malloc(shard, sz, align, payload)
+///   Allocate a guarded block for `sz` bytes aligned to `align` (0 for the
+///   default, otherwise at most a page). Returns its metadata and sets
+///   `*payload`, or returns nullptr on failure.
+static metadata* guard_malloc(m61_shard* shard, size_t sz, size_t align,
+                              char** payload) {
+    size_t page = guard_page_size();
+    if (sz > (size_t) -1 / 2) {
+        return nullptr;
+    }
+    size_t header = meta_outofline ? sizeof(uint64_t) : sizeof(metadata);
+    size_t tail = guard_tail(sz, align);
+    size_t data = (header + tail + page - 1) & ~(page - 1);
+    char* base = nullptr;
+    if (data == page && shard->nrecycled) {
+        base = shard->recycled[--shard->nrecycled].base;
+        if (mprotect(base, page, PROT_READ | PROT_WRITE) != 0) {
+            munmap(base, 2 * page);
+            base = nullptr;
+        }
+    }
+    if (!base) {
+        void* m = mmap(nullptr, data + page, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+            return nullptr;
+        }
+        base = (char*) m;
+        if (mprotect(base + data, page, PROT_NONE) != 0) {
+            munmap(base, data + page);
+            return nullptr;
+        }
+    }
+    *payload = base + data - tail;
+    metadata* meta = meta_outofline ? side_claim(shard, *payload)
+        : (metadata*) *payload - 1;
+    if (!meta) {
+        munmap(base, data + page);
+    }
+    return meta;
+}
+
+/// guard_retire(shard, payload, sz)
+///   Quarantine the guarded mapping holding the `sz`-byte payload at
+///   `payload`, evicting the oldest quarantined mapping if necessary.
+static void guard_retire(m61_shard* shard, char* payload, size_t sz) {
+    // The header starts in the mapping's first page and the trailing byte
+    // ends in its last accessible page, whatever the payload's alignment
+    size_t page = guard_page_size();
+    size_t header = meta_outofline ? sizeof(uint64_t) : sizeof(metadata);
+    uintptr_t base = (uintptr_t) (payload - header) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) payload + sz + 1 + page - 1) & ~(page - 1);
+    size_t data = end - base;
+    guard_map fresh = {(char*) base, data + page};
+    mprotect(fresh.base, data, PROT_NONE);
+
+    guard_map& slot = shard->quarantine[shard->quarantine_next];
+    shard->quarantine_next = (shard->quarantine_next + 1) % guard_quarantine_size;
+    guard_map old = slot;
+    slot = fresh;
+    if (!old.base) {
+        return;
+    } else if (old.length == 2 * page && shard->nrecycled < guard_recycle_size) {
+        shard->recycled[shard->nrecycled++] = old;
+    } else {
+        munmap(old.base, old.length);
+    }
+}
+
+/// Block layout
+///   A base allocator block holds the header (metadata, or the guard word
+///   in out-of-line mode), the payload, and at least 8 bytes for the
+///   trailing byte. Aligned allocations pad the front of the block and
+///   store the block address in the word before the header.
+
+/// place_block(shard, sz, align, zero, payload)
+///   Allocate a block for `sz` payload bytes aligned to `align` (0 for the
+///   default), zeroed if `zero`. Returns the allocation's metadata and sets
+///   `*payload`, or returns nullptr on failure.
+static metadata* place_block(m61_shard* shard, size_t sz, size_t align, bool zero,
+                             char** payload) {
+    size_t header = meta_outofline ? sizeof(uint64_t) : sizeof(metadata);
+    size_t extra = align ? align + sizeof(char*) : 0;
+    if (sz >= (size_t) -1 - 1024 - sizeof(metadata) - extra) {
+        return nullptr;
+    }
+    size_t n = header + sz + sizeof(uint64_t) + extra;
+    char* block = (char*) (zero ? base_calloc(n) : base_malloc(n));
+    if (!block) {
+        return nullptr;
+    }
+    char* p = block + header;
+    if (align) {
+        p = (char*) (((uintptr_t) block + sizeof(char*) + header + align - 1)
+                     & ~(uintptr_t) (align - 1));
+        ((char**) (p - header))[-1] = block;
+    }
+    *payload = p;
+    metadata* meta = meta_outofline ? side_claim(shard, p) : (metadata*) p - 1;
+    if (!meta) {
+        base_free(block);
+    }
+    return meta;
+}
+
+/// block_of(meta, payload)
+///   Return the base allocator block of a non-guarded allocation
+static inline char* block_of(metadata* meta, char* payload) {
+    char* header = meta_outofline ? payload - sizeof(uint64_t) : (char*) meta;
+    return meta->aligned ? ((char**) header)[-1] : header;
+}
+
+/// release_block(shard, meta)
+///   Return the block described by `meta` to the base allocator (or the
+///   guard-page quarantine), and its side-table slot to `shard`. Must run on
+///   the thread that allocated it.
+static void release_block(m61_shard* shard, metadata* meta) {
+    char* payload = payload_of(meta);
+    char* block = meta->guarded ? nullptr : block_of(meta, payload);
+    // An allocation that failed after filling in `meta` must not be
+    // reported as a leak
+    __atomic_store_n(&meta->unfreed, 0, __ATOMIC_RELAXED);
+    if (meta_outofline) {
+        side_entry* e = (side_entry*) meta;
+        uint64_t slot = *((uint64_t*) payload - 1) ^ side_magic;
+        e->payload = nullptr;
+        // A write after free may have clobbered the guard; leak the slot then
+        if (side_entry_at(slot) == e) {
+            shard->free_slots.push_back(slot);
+        }
+    }
+    if (meta->guarded) {
+        guard_retire(shard, payload, meta->size);
+    } else {
+        base_free(block);
+    }
+}
+
+/// find_region(ptr)
+///   Return the active allocation whose payload (including its trailing
+///   byte) contains `ptr`, or nullptr if there is none.
+static metadata* find_region(void* ptr) {
+    uintptr_t addr = index_floor(ptr);
+    if (addr == 0) {
+        return nullptr;
+    }
+    metadata* meta = meta_of(addr);
+    if (meta && (uintptr_t) ptr <= addr + meta->size) {
+        return meta;
+    }
+    return nullptr;
+}
+
+/// hh_hash(file, line)
+///   Helper function to pick the home slot for a call site
+static inline unsigned hh_hash(const char* file, long line) {
+    uint64_t h = ((uintptr_t) file ^ ((uint64_t) line << 32)) * 0x9E3779B97F4A7C15ULL;
+    return h >> 57;   // top 7 bits: hh_nslots == 128
+}
+
+/// hh_erase_slot(hh, s)
+///   Remove hash slot `s`, shifting later entries of its probe run back
+static void hh_erase_slot(hh_sketch& hh, unsigned s) {
+    hh.slots[s] = 0;
+    for (unsigned t = (s + 1) % hh_nslots; hh.slots[t]; t = (t + 1) % hh_nslots) {
+        hhcounter& c = hh.counters[hh.slots[t] - 1];
+        unsigned home = hh_hash(c.file, c.line);
+        // move t into s if its home is not cyclically within (s, t]
+        if ((t - home) % hh_nslots >= (t - s) % hh_nslots) {
+            hh.slots[s] = hh.slots[t];
+            hh.slots[t] = 0;
+            s = t;
+        }
+    }
+}
+
+/// hh_record(hh, file, line, sz)
+///   Add `sz` bytes to the call site `file`:`line`. When all counters are
+///   in use, the smallest one is taken over by the new site, which inherits
+///   its count as error; any site with more than 1/hh_ncounters of all
+///   bytes is guaranteed to be monitored. Counters are stored atomically,
+///   so hhreport can read another thread's sketch. Returns the index of
+///   the site's counter.
+static int hh_record(hh_sketch& hh, const char* file, long line, size_t sz) {
+    unsigned s = hh_hash(file, line);
+    for (; hh.slots[s]; s = (s + 1) % hh_nslots) {
+        hhcounter& c = hh.counters[hh.slots[s] - 1];
+        if (c.line == line && c.file == file) {
+            stat_add(c.size, sz);
+            return hh.slots[s] - 1;
+        }
+    }
+
+    int i;
+    unsigned long long base = 0;
+    if (hh.nused < hh_ncounters) {
+        i = hh.nused;
+    } else {
+        i = 0;
+        for (int j = 1; j != hh_ncounters; ++j) {
+            if (hh.counters[j].size < hh.counters[i].size) {
+                i = j;
+            }
+        }
+        base = hh.counters[i].size;
+        unsigned t = hh_hash(hh.counters[i].file, hh.counters[i].line);
+        while (hh.slots[t] != i + 1) {
+            t = (t + 1) % hh_nslots;
+        }
+        hh_erase_slot(hh, t);
+        for (s = hh_hash(file, line); hh.slots[s]; s = (s + 1) % hh_nslots) {
+        }
+    }
+    hhcounter& c = hh.counters[i];
+    __atomic_store_n(&c.file, file, __ATOMIC_RELAXED);
+    __atomic_store_n(&c.line, line, __ATOMIC_RELAXED);
+    __atomic_store_n(&c.size, base + sz, __ATOMIC_RELAXED);
+    __atomic_store_n(&c.error, base, __ATOMIC_RELAXED);
+    if (int h = hh.hist_of[i]) {
+        __atomic_store_n(&hh.hist_of[i], 0, __ATOMIC_RELAXED);
+        hh.hist_site[h - 1] = 0;
+    }
+    hh.slots[s] = i + 1;
+    if (i == hh.nused) {
+        __atomic_store_n(&hh.nused, i + 1, __ATOMIC_RELEASE);
+    }
+    return i;
+}
+
+/// hh_site_hist(shard, i)
+///   Return the histograms of the shard's counter `i`. A counter without
+///   histograms claims a free set, or takes over the set of the smallest
+///   counter that has one if that counter is smaller; the histograms then
+///   start over. Returns nullptr if counter `i` is too small.
+static hh_hist* hh_site_hist(m61_shard* shard, int i) {
+    hh_sketch& hh = shard->hh;
+    if (int h = hh.hist_of[i]) {
+        return &shard->hists[h - 1];
+    }
+    int victim = -1;
+    unsigned long long victim_size = hh.counters[i].size;
+    for (int h = 0; h != hh_nhists; ++h) {
+        if (!hh.hist_site[h]) {
+            victim = h;
+            break;
+        } else if (hh.counters[hh.hist_site[h] - 1].size < victim_size) {
+            victim = h;
+            victim_size = hh.counters[hh.hist_site[h] - 1].size;
+        }
+    }
+    if (victim < 0) {
+        return nullptr;
+    }
+    if (int old = hh.hist_site[victim]) {
+        __atomic_store_n(&hh.hist_of[old - 1], 0, __ATOMIC_RELAXED);
+    }
+    hh_hist& hist = shard->hists[victim];
+    __atomic_store_n(&hist.file, hh.counters[i].file, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist.line, hh.counters[i].line, __ATOMIC_RELAXED);
+    for (int b = 0; b != m61_nbuckets; ++b) {
+        __atomic_store_n(&hist.size_hist[b], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&hist.lifetime_hist[b], 0, __ATOMIC_RELAXED);
+    }
+    hh.hist_site[victim] = i + 1;
+    __atomic_store_n(&hh.hist_of[i], victim + 1, __ATOMIC_RELAXED);
+    return &hist;
+}
+
+/// Sampling heap profiler
+///   When `prof_rate` is nonzero, each shard counts down an exponentially
+///   distributed number of bytes with mean `prof_rate` and samples the
+///   allocation that crosses zero, as tcmalloc does; larger blocks are thus
+///   proportionally more likely to be sampled. The stack trace of a sample
+///   is aggregated into a fixed-size table of buckets, and the block
+///   remembers its bucket, so the profile shows both allocated and in-use
+///   samples. Only sampled allocations take the lock.
+
+constexpr int prof_max_depth = 32;
+constexpr unsigned prof_nbuckets = 4096;
+
+struct prof_bucket {
+    uint64_t hash;
+    int depth;                          // 0 means unused
+    void* pcs[prof_max_depth];
+    unsigned long long alloc_count;     // sampled allocations
+    unsigned long long alloc_size;
+    unsigned long long live_count;      // sampled allocations not yet freed
+    unsigned long long live_size;
+};
+
+static prof_bucket prof_buckets[prof_nbuckets];
+static std::mutex prof_lock;
+static size_t prof_rate;
+static unsigned long long prof_dropped;   // samples lost to a full table
+
+/// prof_interval(shard, rate)
+///   Draw the number of bytes before the shard's next sample
+static long long prof_interval(m61_shard* shard, size_t rate) {
+    uint64_t& x = shard->prof_random;
+    if (!x) {
+        x = ((uintptr_t) shard * 0x9E3779B97F4A7C15ULL) | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    double u = ((x >> 11) + 1) * 0x1p-53;     // uniform in (0, 1]
+    return (long long) (-log(u) * rate) + 1;
+}
+
+/// prof_sample(shard, sz)
+///   Record a sampled allocation of `sz` bytes made by our caller and start
+///   the next interval. Returns the block's bucket + 1, or 0 if dropped or
+///   not sampled after all. A thread's countdown starts at 0, so its first
+///   allocation always gets here; the first interval is drawn then, and the
+///   allocation is sampled only if it crosses that interval too.
+__attribute__((noinline))
+static int prof_sample(m61_shard* shard, size_t sz) {
+    size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+    if (!shard->prof_started) {
+        shard->prof_started = true;
+        shard->prof_countdown += prof_interval(shard, rate ? rate : 1);
+        if (shard->prof_countdown >= 0) {
+            return 0;
+        }
+    }
+    shard->prof_countdown = prof_interval(shard, rate ? rate : 1);
+
+    // Skip this function and m61_malloc
+    void* pcs[prof_max_depth + 2];
+    int depth = backtrace(pcs, prof_max_depth + 2) - 2;
+    if (depth <= 0) {
+        return 0;
+    }
+    uint64_t hash = 0;
+    for (int i = 0; i != depth; ++i) {
+        hash = (hash + (uintptr_t) pcs[i + 2]) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    std::lock_guard<std::mutex> guard(prof_lock);
+    unsigned b = hash % prof_nbuckets;
+    for (unsigned n = 0; n != prof_nbuckets; ++n, b = (b + 1) % prof_nbuckets) {
+        prof_bucket& pb = prof_buckets[b];
+        if (pb.depth == 0) {
+            pb.hash = hash;
+            memcpy(pb.pcs, pcs + 2, depth * sizeof(void*));
+            pb.depth = depth;
+        } else if (pb.hash != hash || pb.depth != depth
+                   || memcmp(pb.pcs, pcs + 2, depth * sizeof(void*)) != 0) {
+            continue;
+        }
+        ++pb.alloc_count;
+        pb.alloc_size += sz;
+        __atomic_fetch_add(&pb.live_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pb.live_size, sz, __ATOMIC_RELAXED);
+        return b + 1;
+    }
+    ++prof_dropped;
+    return 0;
+}
+
+/// prof_release(bucket, sz)
+///   Record that a sampled block of `sz` bytes in `bucket` was freed
+static void prof_release(int bucket, size_t sz) {
+    prof_bucket& pb = prof_buckets[bucket - 1];
+    __atomic_fetch_sub(&pb.live_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&pb.live_size, sz, __ATOMIC_RELAXED);
+}
+
+/// drain_returns(shard)
+///   Release blocks that other threads freed on behalf of `shard`. The
+///   return stack is linked through the first word of each dead payload
+///   (every block has at least 8 bytes after its metadata or guard word).
+static void drain_returns(m61_shard* shard) {
+    metadata* m = __atomic_exchange_n(&shard->returns, nullptr, __ATOMIC_ACQUIRE);
+    while (m) {
+        metadata* next = *(metadata**) payload_of(m);
+        release_block(shard, m);
+        m = next;
+    }
+}
+
+/// orphan_drain(shard)
+///   Release the blocks returned to the orphaned `shard`, using its base
+///   allocator state, unless another thread is doing so already. That
+///   thread rechecks `returns` when it is done, so no block is stranded.
+static void orphan_drain(m61_shard* shard) {
+    int idle = 1;
+    while (__atomic_load_n(&shard->returns, __ATOMIC_SEQ_CST)
+           && __atomic_compare_exchange_n(&shard->orphan, &idle, 2, false,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        void* mine = base_state_set(shard->base);
+        drain_returns(shard);
+        base_state_set(mine);
+        __atomic_store_n(&shard->orphan, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/// shard_exit(shard)
+///   Thread exit hook. Orphan the exiting thread's shard after releasing
+///   its returned blocks. Runs after the thread's C++ thread_local
+///   destructors; if a later exit hook frees memory, the thread takes over
+///   a shard again and this hook runs once more.
+static void shard_exit(void* shard) {
+    m61_shard* s = (m61_shard*) shard;
+    my_shard = nullptr;
+    base_state_set(nullptr);
+    s->scope_marks.clear();
+    s->scope_blocks.clear();
+    base_state_orphan(s->base, 1);
+    __atomic_store_n(&s->orphan, 1, __ATOMIC_SEQ_CST);
+    orphan_drain(s);
+}
+
+/// scope_member(shard, ptr, depth)
+///   Return the metadata of `ptr`, listed in `shard`'s scope at `depth`, if
+///   it still belongs to that scope, or nullptr. A listed address may have
+///   been freed, or even reused by another allocation; it still belongs to
+///   the scope if it is active, allocated by this thread, and tagged with
+///   the scope's depth: any older allocation with that tag was freed when
+///   its own scope ended.
+static metadata* scope_member(m61_shard* shard, char* ptr, short depth) {
+    metadata* meta;
+    if (!index_contains(ptr) || !(meta = meta_of((uintptr_t) ptr))
+        || meta->owner != shard || meta->scope != depth) {
+        return nullptr;
+    }
+    return meta;
+}
+
+/// scope_compact(shard)
+///   Drop the entries of the open scopes that no longer belong to them, and
+///   duplicates left by reused addresses, so a long-lived scope whose
+///   blocks are freed one by one does not list them forever. Each scope's
+///   entries end up in address order. The next compaction happens when the
+///   list has doubled, so its cost is spread thinly over the allocations.
+constexpr size_t scope_compact_min = 1024;
+
+static void scope_compact(m61_shard* shard) {
+    auto& blocks = shard->scope_blocks;
+    auto& marks = shard->scope_marks;
+    size_t out = marks[0];
+    for (size_t d = 0; d != marks.size(); ++d) {
+        size_t end = d + 1 == marks.size() ? blocks.size() : marks[d + 1];
+        size_t i = marks[d];
+        marks[d] = out;
+        for (; i != end; ++i) {
+            if (scope_member(shard, blocks[i], d + 1)) {
+                blocks[out++] = blocks[i];
+            }
+        }
+        std::sort(blocks.begin() + marks[d], blocks.begin() + out);
+        out = std::unique(blocks.begin() + marks[d], blocks.begin() + out) - blocks.begin();
+    }
+    blocks.resize(out);
+    shard->scope_compact_at = std::max(2 * out, scope_compact_min);
+}
+
+/// account_allocation(shard, meta, ptr)
+///    Count the allocation described by `meta` at `ptr` in the shard's
+///    statistics and heavy hitters, the heap bounds and the export.
+
+static void account_allocation(m61_shard* shard, metadata* meta, char* ptr) {
+    size_t sz = meta->size;
+    int b = hist_bucket(sz);
+    meta->serial = shard->stats.ntotal;
+    stat_add(shard->stats.nactive, 1);
+    stat_add(shard->stats.active_size, sz);
+    stat_add(shard->stats.ntotal, 1);
+    stat_add(shard->stats.total_size, sz);
+    stat_add(shard->stats.size_hist[b], 1);
+    if(ptr < __atomic_load_n(&heap_min, __ATOMIC_RELAXED)
+       || ptr + sz > __atomic_load_n(&heap_max, __ATOMIC_RELAXED)
+       || !heap_min){
+      heap_extend(ptr, ptr + sz);
+    }
+
+    export_changed(shard, sz);
+
+    // Update heavy hitters sketch and the site's size histogram
+    meta->site = hh_record(shard->hh, meta->file, meta->line, sz);
+    if(hh_hist* hist = hh_site_hist(shard, meta->site)){
+      stat_add(hist->size_hist[b], 1);
+    }
+
+    // Join the innermost open scope
+    meta->scope = shard->scope_marks.size();
+    if(meta->scope){
+      if(shard->scope_blocks.size() >= shard->scope_compact_at){
+        scope_compact(shard);
+      }
+      shard->scope_blocks.push_back(ptr);
+    }
+}
+
+
+/// m61_allocate(sz, file, line, zero, align)
+///    Shared body of m61_malloc, m61_calloc and m61_aligned_alloc. If
+///    `zero`, the payload is zeroed; if `align` is nonzero, the payload is
+///    aligned to it. Always inlined so the profiler's stack traces start
+///    at the public function.
+
+__attribute__((always_inline))
+static inline void* m61_allocate(size_t sz, const char* file, long line, bool zero,
+                                 size_t align) {
+    m61_shard* shard = current_shard();
+    if (__atomic_load_n(&shard->returns, __ATOMIC_RELAXED)) {
+        drain_returns(shard);
+    }
 
-void* m61_malloc(size_t sz, const char* file, long line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    
     // Create metadata struct
     metadata data = {};
     data.size = sz;
-    data.id = id;
-    data.unfreed = unfreed_id;
     data.file = (char*) file;
+    data.owner = shard;
     data.line = line;
+    data.unfreed = unfreed_id;
 
-    // Check for size
-    if(sz >= (size_t) -1 - 1024 - gstats.active_size - sizeof(metadata)){
-      gstats.nfail++;
-      gstats.fail_size += sz;
-      return nullptr;
+    // Check for size, then allocate the block and find its metadata and
+    // payload
+    metadata* metaptr = nullptr;
+    char* ptr = nullptr;
+    if(align <= (meta_outofline ? 8 : 16)){
+      align = 0;                  // default alignment suffices
     }
-
-    // Create pointer to overall allocation, including metadata
-    metadata* metaptr = (metadata*) base_malloc(sz + sizeof(metadata) + sizeof(size_t) + 8);
-    *metaptr = data;
-
-    // Update alloc list pointers
-    metaptr->next = base_meta.next;
-    metaptr->last = &base_meta;
-    if(base_meta.next != nullptr){
-      (base_meta.next)->last = metaptr;
+    data.aligned = align != 0;
+    if(__atomic_load_n(&guard_rate, __ATOMIC_RELAXED)
+       && align <= guard_page_size() && shard->guard_countdown-- == 0){
+      shard->guard_countdown = __atomic_load_n(&guard_rate, __ATOMIC_RELAXED) - 1;
+      metaptr = guard_malloc(shard, sz, align, &ptr);
+      data.guarded = 1;
+      if(metaptr && zero){
+        memset(ptr, 0, sz);       // recycled guard pages are not zero
+      }
+    } else {
+      metaptr = place_block(shard, sz, align, zero, &ptr);
     }
-    base_meta.next = metaptr;
 
-    // Create pointer to payload, instead of metadata
-    void* ptr = (void*) ((char*) metaptr + sizeof(metadata));
+    // Add to active allocation index, which fails only if no memory is
+    // left for its nodes
+    if(metaptr){
+      *metaptr = data;
+      if(!index_insert(ptr)){
+        release_block(shard, metaptr);
+        metaptr = nullptr;
+      }
+    }
+    if(metaptr == nullptr){
+      stat_add(shard->stats.nfail, 1);
+      stat_add_sat(shard->stats.fail_size, sz);
+      export_changed(shard, -1);
+      return nullptr;
+    }
+    if(__atomic_load_n(&prof_rate, __ATOMIC_RELAXED)
+       && (shard->prof_countdown -= sz) < 0){
+      metaptr->bucket = prof_sample(shard, sz);
+    }
 
     // Create pointer to trailing byte, assign id to that pointer
-    char* trailptr = (char*) ptr + sz;
+    char* trailptr = ptr + sz;
     *trailptr = idc;
 
     // Update stats
-    gstats.nactive++;
-    gstats.active_size += sz;
-    gstats.ntotal++;
-    gstats.total_size += sz;
-    if(((char*) ptr < gstats.heap_min) || gstats.heap_min == nullptr){
-      gstats.heap_min = (char*) ptr;
-    }
-    if(((char*) ptr + sz > gstats.heap_max) || gstats.heap_min == nullptr){
-      gstats.heap_max = (char*) ptr + sz;
-    }
-
-    // Update heavy hitters vector
-    hhstruct hhdata =  {std::pair(file, line), sz};
-    hhvec.push_back(hhdata);
+    account_allocation(shard, metaptr, ptr);
 
     return(ptr);
 }
 
 
-/// m61_free(ptr, file, line)
-///    Free the memory space pointed to by `ptr`, which must have been
-///    returned by a previous call to m61_malloc. If `ptr == NULL`,
-///    does nothing. The free was called at location `file`:`line`.
+/// m61_malloc(sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory.
+///    The memory is not initialized. If `sz == 0`, then m61_malloc must
+///    return a unique, newly-allocated pointer value. The allocation
+///    request was at location `file`:`line`.
 
-void m61_free(void* ptr, const char* file, long line) {
+void* m61_malloc(size_t sz, const char* file, long line) {
     (void) file, (void) line;   // avoid uninitialized variable warnings
+    return m61_allocate(sz, file, line, false, 0);
+}
 
-    // Calculate pointer to metadata
-    metadata* metaptr = (metadata*) ((char*) ptr - sizeof(metadata));
 
-    // Check for nullptr
-    if(ptr == nullptr){
+/// record_lifetime(shard, meta)
+///    Record the lifetime of the allocation `meta`, freed on `shard`'s
+///    thread, in allocations its owner made meanwhile. It is counted in
+///    the shard's histogram and in the call site's histogram if the owner
+///    still keeps one. Histograms of other threads need an atomic add.
+
+static void record_lifetime(m61_shard* shard, metadata* meta) {
+    m61_shard* owner = meta->owner;
+    unsigned long long lifetime = __atomic_load_n(&owner->stats.ntotal, __ATOMIC_RELAXED)
+        - meta->serial - 1;
+    int b = hist_bucket(lifetime);
+    stat_add(shard->stats.lifetime_hist[b], 1);
+    int h = __atomic_load_n(&owner->hh.hist_of[meta->site], __ATOMIC_RELAXED);
+    if(!h){
       return;
     }
-    
-    // Check if pointer points to heap
-    if(ptr < gstats.heap_min || ptr > gstats.heap_max){
-      printf("MEMORY BUG %s:%li: invalid free of pointer %p, not in heap\n", file, line, ptr);
-      return;
+    hh_hist& hist = owner->hists[h - 1];
+    if(__atomic_load_n(&hist.file, __ATOMIC_RELAXED) == meta->file
+       && __atomic_load_n(&hist.line, __ATOMIC_RELAXED) == meta->line){
+      if(owner == shard){
+        stat_add(hist.lifetime_hist[b], 1);
+      } else {
+        __atomic_fetch_add(&hist.lifetime_hist[b], 1, __ATOMIC_RELAXED);
+      }
     }
+}
 
-    // Check for invalid pointer
-    if((((uintptr_t) ptr & 7) != 0) || (metaptr->id != id)){
-      printf("MEMORY BUG: %s:%li: invalid free of pointer %p, not allocated\n", file, line, ptr);
-      
-      // Check if pointer points inside existing allocation
-      metadata* checkptr = base_meta.next;
-      while(checkptr != nullptr){
-        if(inrange(ptr, checkptr)){
-          unsigned long offset = (char*) ptr - ((char*) checkptr + sizeof(metadata));
-          printf("  %s:%i: %p is %lu bytes inside a %lu byte region allocated here\n", 
-                 file, checkptr->line, ptr, offset, checkptr->size);
-          break;
-        }
-        checkptr = checkptr->next;
-      }
 
-    return;
+/// check_block(ptr, op, file, line)
+///    Check that `ptr` is an active allocation being passed to `op` (such
+///    as "free") at `file`:`line`. Returns its metadata, or prints a memory
+///    bug report and returns nullptr.
+
+static metadata* check_block(void* ptr, const char* op, const char* file, long line) {
+    // Check if pointer points to heap
+    if(ptr < __atomic_load_n(&heap_min, __ATOMIC_RELAXED)
+       || ptr > __atomic_load_n(&heap_max, __ATOMIC_RELAXED)){
+      printf("MEMORY BUG %s:%li: invalid %s of pointer %p, not in heap\n", file, line, op, ptr);
+      return nullptr;
     }
 
-    // Check for sneaky frees
-    if(metaptr->next != nullptr){
-      if(metaptr->next->last != metaptr){
-        printf("MEMORY BUG: %s:%li: invalid free of pointer %p, not allocated\n", 
-            file, line, ptr);
+    // Check for invalid pointer: only active allocations are in the index,
+    // so this also catches double frees
+    if((((uintptr_t) ptr & 7) != 0) || !index_contains(ptr)){
+      printf("MEMORY BUG: %s:%li: invalid %s of pointer %p, not allocated\n", file, line, op, ptr);
+
+      // Check if pointer points inside existing allocation
+      if(metadata* region = find_region(ptr)){
+        unsigned long offset = (char*) ptr - payload_of(region);
+        printf("  %s:%i: %p is %lu bytes inside a %lu byte region allocated here\n",
+               region->file, region->line, ptr, offset, region->size);
       }
+      return nullptr;
     }
-    if(metaptr->last != nullptr){
-      if(metaptr->last->next != metaptr){
-        printf("MEMORY BUG: %s:%li: invalid free of pointer %p, not allocated\n", 
-            file, line, ptr);
-      }
+    metadata* metaptr = meta_of((uintptr_t) ptr);
+
+    // Check for corruption of the guard word (out-of-line mode) and of
+    // trailing data
+    if(metaptr == nullptr || ((char*) ptr)[metaptr->size] != idc){
+      printf("MEMORY BUG: %s:%li: detected wild write during %s of pointer %p\n",
+          file, line, op, ptr);
+      return nullptr;
     }
-      
-    // Check for double free
-    bool dbfreed = was_freed(metaptr);
-    if(metaptr->id == id && dbfreed){
-      printf("MEMORY BUG: %s:%li: invalid free of pointer %p\n", file, line, ptr);
+    return metaptr;
+}
+
+
+/// m61_free(ptr, file, line)
+///    Free the memory space pointed to by `ptr`, which must have been
+///    returned by a previous call to m61_malloc. If `ptr == NULL`,
+///    does nothing. The free was called at location `file`:`line`.
+
+void m61_free(void* ptr, const char* file, long line) {
+    (void) file, (void) line;   // avoid uninitialized variable warnings
+
+    // Check for nullptr
+    if(ptr == nullptr){
       return;
     }
 
-    // Check for corruption of trailing data
-    char* trailptr = (char*) ptr + metaptr->size;
-    if(*trailptr != idc){
-      printf("MEMORY BUG: %s:%li: detected wild write during free of pointer %p\n",
-          file, line, ptr);
+    metadata* metaptr = check_block(ptr, "free", file, line);
+    if(metaptr == nullptr){
       return;
     }
 
-    // Update metadata linked list
-    if(metaptr->next != nullptr){
-      (metaptr->next)->last = metaptr->last;
+    // Remove from active allocation index. This claims the block: it fails
+    // if another thread is freeing the same pointer concurrently.
+    if(!index_erase(ptr)){
+      printf("MEMORY BUG: %s:%li: invalid free of pointer %p\n", file, line, ptr);
+      return;
     }
-    if(metaptr->last != nullptr){
-      (metaptr->last)->next = metaptr->next;
+    metaptr->unfreed = 0;
+    if(metaptr->bucket){
+      prof_release(metaptr->bucket, metaptr->size);
     }
-    else{
-      base_meta.next = metaptr->next;
+
+    // Update stats. Per-thread counts may go negative; the sum is right.
+    m61_shard* shard = current_shard();
+    m61_shard* owner = metaptr->owner;
+    stat_add(shard->stats.active_size, -metaptr->size);
+    stat_add(shard->stats.nactive, -1);
+    export_changed(shard, -1);
+
+    record_lifetime(shard, metaptr);
+
+    // Release the block through the thread that allocated it, or right
+    // away if that thread has exited
+    if(owner == shard){
+      release_block(shard, metaptr);
+    } else {
+      metadata* head = __atomic_load_n(&owner->returns, __ATOMIC_RELAXED);
+      do {
+        *(metadata**) ptr = head;
+      } while(!__atomic_compare_exchange_n(&owner->returns, &head, metaptr, true,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+      if(__atomic_load_n(&owner->orphan, __ATOMIC_SEQ_CST)){
+        orphan_drain(owner);
+      }
     }
 
-    // Update stats and wipe id from metadata
-    gstats.active_size -= (metaptr->size);
-    gstats.nactive--;
-    metaptr->unfreed = 0;
-    base_free(metaptr);
-    
     return;
 }
 
@@ -215,37 +1412,231 @@ void m61_free(void* ptr, const char* file, long line) {
 ///    hold an array of `nmemb` elements of `sz` bytes each. If `sz == 0`,
 ///    then must return a unique, newly-allocated pointer value. Returned
 ///    memory should be initialized to zero. The allocation request was at
-///    location `file`:`line`.
+///    location `file`:`line`. Large blocks come from fresh pages, which
+///    are already zero, so only small blocks are cleared by hand.
 
 void* m61_calloc(size_t nmemb, size_t sz, const char* file, long line) {
-   
-    // Check for overflow
-    if(overflowed(nmemb, sz)){
-        gstats.nfail++;
+
+    // Check for overflow. The request has no size, so count the failure
+    // but leave `fail_size` alone.
+    size_t total;
+    if(__builtin_mul_overflow(nmemb, sz, &total)){
+        m61_shard* shard = current_shard();
+        stat_add(shard->stats.nfail, 1);
+        export_changed(shard, -1);
         return nullptr;
     }
 
-    void* ptr = m61_malloc(nmemb * sz, file, line);
-    if (ptr != nullptr) {
-        memset(ptr, 0, nmemb * sz);
+    return m61_allocate(total, file, line, true, 0);
+}
+
+
+/// m61_realloc(ptr, sz, file, line)
+///    Change the size of the allocation at `ptr` to `sz` bytes and return
+///    its address, or return nullptr and leave it unchanged on failure. If
+///    `ptr == NULL`, behaves like m61_malloc. A block grows or shrinks in
+///    place, without a copy, when it was allocated by this thread and its
+///    base block has room for the new size and the trailing byte;
+///    otherwise the contents move to a new allocation. Either way the
+///    statistics count a new allocation and the free of the old one, in
+///    that order. The request was at location `file`:`line`.
+
+void* m61_realloc(void* ptr, size_t sz, const char* file, long line) {
+    if(ptr == nullptr){
+      return m61_allocate(sz, file, line, false, 0);
+    }
+
+    metadata* metaptr = check_block(ptr, "realloc", file, line);
+    if(metaptr == nullptr){
+      return nullptr;
+    }
+
+    // Resize in place if the base block has room
+    m61_shard* shard = current_shard();
+    char* payload = (char*) ptr;
+    if(metaptr->owner == shard && !metaptr->guarded){
+      char* block = block_of(metaptr, payload);
+      size_t off = payload - block;
+      if(sz < base_usable_size(block) - off){
+        metadata old = *metaptr;
+        if(metaptr->bucket){
+          prof_release(metaptr->bucket, metaptr->size);
+          metaptr->bucket = 0;
+        }
+        metaptr->size = sz;
+        metaptr->file = (char*) file;
+        metaptr->line = line;
+        payload[sz] = idc;
+        if(__atomic_load_n(&prof_rate, __ATOMIC_RELAXED)
+           && (shard->prof_countdown -= sz) < 0){
+          metaptr->bucket = prof_sample(shard, sz);
+        }
+        account_allocation(shard, metaptr, payload);
+        stat_add(shard->stats.nactive, -1);
+        stat_add(shard->stats.active_size, -old.size);
+        export_changed(shard, -1);
+        record_lifetime(shard, &old);
+        return ptr;
+      }
+    }
+
+    // Otherwise move the contents
+    size_t old_size = metaptr->size;
+    void* newptr = m61_allocate(sz, file, line, false, 0);
+    if(newptr){
+      memcpy(newptr, ptr, std::min(old_size, sz));
+      m61_free(ptr, file, line);
+    }
+    return newptr;
+}
+
+
+/// m61_aligned_alloc(align, sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory
+///    whose address is a multiple of `align`, or nullptr if `align` is
+///    not a power of two. The allocation request was at location
+///    `file`:`line`.
+
+void* m61_aligned_alloc(size_t align, size_t sz, const char* file, long line) {
+    if(align == 0 || (align & (align - 1)) != 0
+       || align > ((size_t) 1 << 30)){
+      m61_shard* shard = current_shard();
+      stat_add(shard->stats.nfail, 1);
+      stat_add_sat(shard->stats.fail_size, sz);
+      export_changed(shard, -1);
+      return nullptr;
     }
-    return ptr;
+    return m61_allocate(sz, file, line, false, align);
+}
+
+
+/// m61_posix_memalign(ptr, align, sz, file, line)
+///    Like m61_aligned_alloc, but `align` must also be a nonzero multiple of
+///    sizeof(void*). Stores the new pointer in `*ptr` and returns 0, or
+///    returns EINVAL or ENOMEM.
+
+int m61_posix_memalign(void** ptr, size_t align, size_t sz, const char* file, long line) {
+    if(align == 0 || align % sizeof(void*) != 0 || (align & (align - 1)) != 0){
+      return EINVAL;
+    }
+    void* p = m61_aligned_alloc(align, sz, file, line);
+    if(p == nullptr){
+      return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+
+/// m61_scope_begin()
+///    Open a scope on the calling thread and return its depth.
+
+int m61_scope_begin() {
+    m61_shard* shard = current_shard();
+    assert(shard->scope_marks.size() < 32767);
+    shard->scope_marks.push_back(shard->scope_blocks.size());
+    return shard->scope_marks.size();
+}
+
+
+/// m61_scope_end(file, line)
+///    Close the calling thread's innermost scope and free its active
+///    allocations in one pass. `scope_blocks` lists the allocations made
+///    in the scope, including ones freed since the last scope_compact;
+///    scope_member tells which still belong to it. Duplicates are caught
+///    when the index claims the block.
+
+void m61_scope_end(const char* file, long line) {
+    m61_shard* shard = current_shard();
+    if(shard->scope_marks.empty()){
+      printf("MEMORY BUG: %s:%li: scope end without scope begin\n", file, line);
+      return;
+    }
+    short depth = shard->scope_marks.size();
+    size_t mark = shard->scope_marks.back();
+    shard->scope_marks.pop_back();
+
+    // Free the scope's active allocations, checking each trailing byte
+    unsigned long long nfreed = 0, freed_size = 0;
+    char** blocks = shard->scope_blocks.data() + mark;
+    for(size_t i = 0; i != shard->scope_blocks.size() - mark; ++i){
+      char* ptr = blocks[i];
+      metadata* metaptr = scope_member(shard, ptr, depth);
+      if(!metaptr){
+        continue;               // freed, or the address now belongs elsewhere
+      }
+      if(ptr[metaptr->size] != idc){
+        printf("MEMORY BUG: %s:%li: detected wild write during scope end of pointer %p\n",
+               file, line, ptr);
+        continue;
+      }
+      if(!index_erase(ptr)){
+        continue;               // listed twice, or freed by another thread
+      }
+      metaptr->unfreed = 0;
+      if(metaptr->bucket){
+        prof_release(metaptr->bucket, metaptr->size);
+      }
+      ++nfreed;
+      freed_size += metaptr->size;
+      record_lifetime(shard, metaptr);
+      release_block(shard, metaptr);
+    }
+    shard->scope_blocks.resize(mark);
+
+    stat_add(shard->stats.active_size, -freed_size);
+    stat_add(shard->stats.nactive, -nfreed);
+    export_changed(shard, -1);
 }
 
 
 /// m61_getstatistics(stats)
-///    Store the current memory statistics in `*stats`.
+///    Store the current memory statistics in `*stats`. Sums the shards of
+///    all threads, including threads that have exited.
 void m61_getstatistics(m61_statistics* stats) {
-    // Stub: set all statistics to enormous numbers
-    memset(stats, 255, sizeof(m61_statistics));
-    *stats = gstats;
+    memset(stats, 0, sizeof(m61_statistics));
+    for (m61_shard* s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+        stats->nactive += __atomic_load_n(&s->stats.nactive, __ATOMIC_RELAXED);
+        stats->active_size += __atomic_load_n(&s->stats.active_size, __ATOMIC_RELAXED);
+        stats->ntotal += __atomic_load_n(&s->stats.ntotal, __ATOMIC_RELAXED);
+        stats->total_size += __atomic_load_n(&s->stats.total_size, __ATOMIC_RELAXED);
+        stats->nfail += __atomic_load_n(&s->stats.nfail, __ATOMIC_RELAXED);
+        if (__builtin_add_overflow(stats->fail_size,
+                                   __atomic_load_n(&s->stats.fail_size, __ATOMIC_RELAXED),
+                                   &stats->fail_size)) {
+            stats->fail_size = ~0ULL;
+        }
+        for (int b = 0; b != m61_nbuckets; ++b) {
+            stats->size_hist[b] += __atomic_load_n(&s->stats.size_hist[b], __ATOMIC_RELAXED);
+            stats->lifetime_hist[b] += __atomic_load_n(&s->stats.lifetime_hist[b], __ATOMIC_RELAXED);
+        }
+    }
+    stats->heap_min = __atomic_load_n(&heap_min, __ATOMIC_RELAXED);
+    stats->heap_max = __atomic_load_n(&heap_max, __ATOMIC_RELAXED);
 }
 
 
-/// m61_printstatistics()
+/// print_histogram(title, hist)
+///    Print the nonempty buckets of an m61 histogram
+static void print_histogram(const char* title, const unsigned long long* hist) {
+    printf("%s\n", title);
+    for (int b = 0; b != m61_nbuckets; ++b) {
+        if (hist[b] == 0) {
+            continue;
+        }
+        unsigned long long lo = b ? 1ULL << (b - 1) : 0;
+        if (b == m61_nbuckets - 1) {
+            printf("  %12llu+             %12llu\n", lo, hist[b]);
+        } else {
+            printf("  %12llu - %-12llu %12llu\n", lo, (1ULL << b) - 1, hist[b]);
+        }
+    }
+}
+
+/// m61_printstatistics(detail)
 ///    Print the current memory statistics.
 
-void m61_printstatistics() {
+void m61_printstatistics(int detail) {
     m61_statistics stats;
     m61_getstatistics(&stats);
 
@@ -253,6 +1644,22 @@ void m61_printstatistics() {
            stats.nactive, stats.ntotal, stats.nfail);
     printf("alloc size:  active %10llu   total %10llu   fail %10llu\n",
            stats.active_size, stats.total_size, stats.fail_size);
+    if (!detail) {
+        return;
+    }
+
+    print_histogram("size histogram:", stats.size_hist);
+    print_histogram("lifetime histogram (allocations while live):", stats.lifetime_hist);
+    m61_sitestatistics sites[5];
+    int nsites = m61_getsitestatistics(sites, 5);
+    for (int i = 0; i != nsites; ++i) {
+        const hhcounter& c = sites[i].site;
+        char title[BUFSIZ];
+        snprintf(title, sizeof(title), "%s:%li: size histogram:", c.file, c.line);
+        print_histogram(title, sites[i].size_hist);
+        snprintf(title, sizeof(title), "%s:%li: lifetime histogram:", c.file, c.line);
+        print_histogram(title, sites[i].lifetime_hist);
+    }
 }
 
 
@@ -261,54 +1668,221 @@ void m61_printstatistics() {
 ///    memory.
 
 void m61_printleakreport() {
-  metadata* next = base_meta.next;
-  while(next != nullptr){
-    char* file  = next->file;
-    long int line = next->line;
-    long long int sz = next->size;
-    printf("LEAK CHECK: %s:%li: allocated object %p with size %lli\n", 
-           file, line, (metadata*) ((char*) next + sizeof(metadata)), sz);
-    next = next->next; 
+  if(meta_outofline){
+    // Scan the side table in slot order; no payload memory is touched
+    size_t npages = std::min(__atomic_load_n(&side_npages, __ATOMIC_RELAXED), side_max_pages);
+    for(size_t p = 0; p != npages; p++){
+      side_entry* page = __atomic_load_n(&side_pages[p], __ATOMIC_ACQUIRE);
+      for(size_t i = 0; page && i != side_page_slots; i++){
+        const metadata& meta = page[i].meta;
+        if(__atomic_load_n(&meta.unfreed, __ATOMIC_RELAXED) == unfreed_id){
+          printf("LEAK CHECK: %s:%i: allocated object %p with size %zu\n",
+                 meta.file, meta.line, (void*) page[i].payload, meta.size);
+        }
+      }
+    }
+    return;
   }
+  index_for_each([] (uintptr_t addr) {
+    metadata* meta = meta_of(addr);
+    printf("LEAK CHECK: %s:%i: allocated object %p with size %zu\n",
+           meta->file, meta->line, (void*) addr, meta->size);
+  });
   return;
 }
 
+/// m61_getsitestatistics(sites, nsites)
+///   Merge the per-thread sketches into one sketch of the same size, on the
+///   stack, and copy out its `nsites` largest counters with the histograms
+///   every thread keeps for them. This costs O(threads * k) and can be
+///   called at any time.
+
+int m61_getsitestatistics(m61_sitestatistics* sites, int nsites) {
+  hh_sketch merged = {};
+  for(m61_shard* s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+    int n = __atomic_load_n(&s->hh.nused, __ATOMIC_ACQUIRE);
+    for(int i = 0; i != n; i++) {
+      hhcounter& c = s->hh.counters[i];
+      hh_record(merged, __atomic_load_n(&c.file, __ATOMIC_RELAXED),
+                __atomic_load_n(&c.line, __ATOMIC_RELAXED),
+                __atomic_load_n(&c.size, __ATOMIC_RELAXED));
+    }
+  }
+
+  // Select the top counters by size and sum their histograms
+  bool taken[hh_ncounters] = {};
+  int n = 0;
+  for(; n != nsites; n++) {
+    int best = -1;
+    for(int i = 0; i != merged.nused; i++) {
+      if(!taken[i] && (best < 0 || merged.counters[i].size > merged.counters[best].size)) {
+        best = i;
+      }
+    }
+    if(best < 0) {
+      break;
+    }
+    taken[best] = true;
+    m61_sitestatistics& site = sites[n];
+    memset(&site, 0, sizeof(site));
+    site.site = merged.counters[best];
+    for(m61_shard* s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+      for(int h = 0; h != hh_nhists; h++) {
+        const hh_hist& hist = s->hists[h];
+        if(__atomic_load_n(&hist.file, __ATOMIC_RELAXED) != site.site.file
+           || __atomic_load_n(&hist.line, __ATOMIC_RELAXED) != site.site.line) {
+          continue;
+        }
+        for(int b = 0; b != m61_nbuckets; b++) {
+          site.size_hist[b] += __atomic_load_n(&hist.size_hist[b], __ATOMIC_RELAXED);
+          site.lifetime_hist[b] += __atomic_load_n(&hist.lifetime_hist[b], __ATOMIC_RELAXED);
+        }
+      }
+    }
+  }
+  return n;
+}
+
 /// hhreport()
-///   Heavy hitter report prints a report of the lines of code allocating 
+///   Heavy hitter report prints a report of the lines of code allocating
 ///   the most memory.
 
 void hhreport() {
-  
-  // Sort vector by line number
-  std::sort (hhvec.begin(), hhvec.end(), line_before);
-  
-  // Condense list into entries for each line number, with total size summed
-  hh_vec condensed;
-  condensed.push_back(hhvec[0]);
-  for(unsigned int i = 1; i != hhvec.size(); i++) {
-    if(hhvec[i].file_line == condensed.back().file_line) {
-      condensed.back().size = condensed.back().size + hhvec[i].size;
-    }
-    else {
-      condensed.push_back(hhvec[i]);
+  constexpr int ntop = 5;
+  m61_sitestatistics top[ntop];
+  int n = m61_getsitestatistics(top, ntop);
+  unsigned long long total_size = 0;
+  for(m61_shard* s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+    total_size += __atomic_load_n(&s->stats.total_size, __ATOMIC_RELAXED);
+  }
+
+  for(int i = 0; i != n; i++) {
+    const hhcounter& c = top[i].site;
+    double percent = total_size ? c.size * 100.0 / total_size : 0;
+    printf("HEAVY HITTER: %s:%li: %llu bytes (~%.1f%%)\n",
+           c.file, c.line, c.size, percent);
+  }
+  return;
+}
+
+/// m61_metadata_outofline(is_enabled)
+///   Select out-of-line metadata. Blocks of the two layouts cannot be mixed,
+///   so the call is ignored once any thread has allocated.
+
+void m61_metadata_outofline(int is_enabled) {
+  if(!__atomic_load_n(&shards, __ATOMIC_ACQUIRE)){
+    meta_outofline = is_enabled;
+  }
+}
+
+/// m61_guard_pages(rate)
+///   Guard 1 in `rate` allocations with an inaccessible page; 0 disables.
+///   Each thread picks up a new rate when its current interval runs out.
+
+void m61_guard_pages(unsigned rate) {
+  __atomic_store_n(&guard_rate, rate, __ATOMIC_RELAXED);
+}
+
+/// m61_profile_sample(rate)
+///   Sample on average once every `rate` allocated bytes; 0 disables.
+
+void m61_profile_sample(size_t rate) {
+  __atomic_store_n(&prof_rate, rate, __ATOMIC_RELAXED);
+}
+
+/// m61_profile_dump(f)
+///   Write the profile in the legacy text format `pprof` reads for heap
+///   profiles: a header with totals and the sampling rate, one line of
+///   in-use and allocated sample counts and bytes per stack, then the
+///   process's memory map so `pprof` can symbolize addresses. Counts are
+///   of samples; `pprof` scales them by the rate.
+
+void m61_profile_dump(FILE* f) {
+  std::lock_guard<std::mutex> guard(prof_lock);
+  unsigned long long live_count = 0, live_size = 0, alloc_count = 0, alloc_size = 0;
+  for(const prof_bucket& pb : prof_buckets) {
+    live_count += __atomic_load_n(&pb.live_count, __ATOMIC_RELAXED);
+    live_size += __atomic_load_n(&pb.live_size, __ATOMIC_RELAXED);
+    alloc_count += pb.alloc_count;
+    alloc_size += pb.alloc_size;
+  }
+  fprintf(f, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+          live_count, live_size, alloc_count, alloc_size,
+          __atomic_load_n(&prof_rate, __ATOMIC_RELAXED));
+  for(const prof_bucket& pb : prof_buckets) {
+    if(pb.depth == 0) {
+      continue;
     }
+    fprintf(f, "%llu: %llu [%llu: %llu] @",
+            __atomic_load_n(&pb.live_count, __ATOMIC_RELAXED),
+            __atomic_load_n(&pb.live_size, __ATOMIC_RELAXED),
+            pb.alloc_count, pb.alloc_size);
+    for(int i = 0; i != pb.depth; i++) {
+      fprintf(f, " %p", pb.pcs[i]);
+    }
+    fprintf(f, "\n");
+  }
+  if(prof_dropped) {
+    fprintf(f, "# %llu samples dropped: profile table full\n", prof_dropped);
   }
-  // Sort list by size
-  std::sort (condensed.begin(), condensed.end(), size_bigger);
-
-  // Get and print top 5, if over 20%
-  // use stats.total_size
-  for(int i=5; i!=0; i--) {
-    float percent = gstats.total_size / condensed[i].size;
-    if (percent >= 20) {
-      printf("HEAVY HITTER: %s:%li: %lu bytes (~%.3f\%)\n", 
-             std::get<const char*>(condensed[i].file_line), 
-             std::get<long int>(condensed[i].file_line), 
-             condensed[i].size, 
-             percent);
+
+  fprintf(f, "\nMAPPED_LIBRARIES:\n");
+  if(FILE* maps = fopen("/proc/self/maps", "r")) {
+    char buf[BUFSIZ];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+      fwrite(buf, 1, n, f);
     }
+    fclose(maps);
   }
-return;
+}
+
+/// m61_export_statistics(name)
+///   Create and map the shared memory object `name` and start publishing
+///   statistics there. Only the first successful call has any effect.
+
+int m61_export_statistics(const char* name) {
+  static std::mutex export_lock;
+  std::lock_guard<std::mutex> guard(export_lock);
+  if(export_seg){
+    return 0;
+  }
+  if(strlen(name) >= sizeof(export_name)){
+    return -1;
+  }
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if(fd < 0){
+    return -1;
+  }
+  void* m = MAP_FAILED;
+  if(ftruncate(fd, sizeof(m61_export_segment)) == 0){
+    m = mmap(nullptr, sizeof(m61_export_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if(m == MAP_FAILED){
+    shm_unlink(name);
+    return -1;
+  }
+
+  m61_export_segment* seg = (m61_export_segment*) m;
+  seg->pid = getpid();
+  seg->heap_min = (uintptr_t) __atomic_load_n(&heap_min, __ATOMIC_RELAXED);
+  seg->heap_max = (uintptr_t) __atomic_load_n(&heap_max, __ATOMIC_RELAXED);
+
+  // Publish the threads that exist already; idle ones would otherwise
+  // never claim a slot. Their owners see the slots once `export_seg` is
+  // set, and bring them up to date on their next change.
+  for(m61_shard* s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next){
+    s->export_slot = export_claim(seg);
+    if(s->export_slot != &export_full){
+      export_copy(s->export_slot, s, 0, m61_nbuckets);
+    }
+  }
+  __atomic_store_n(&seg->magic, m61_export_magic, __ATOMIC_RELEASE);
+  strcpy(export_name, name);
+  atexit([] () { shm_unlink(export_name); });
+  __atomic_store_n(&export_seg, seg, __ATOMIC_RELEASE);
+  return 0;
 }
 
 thread_local const char* m61_file = "?";
@@ -332,3 +1906,21 @@ void operator delete[](void* ptr) noexcept {
 void operator delete[](void* ptr, size_t) noexcept {
     m61_free(ptr, m61_file, m61_line);
 }
+void* operator new(size_t sz, std::align_val_t align) {
+    return m61_aligned_alloc((size_t) align, sz, m61_file, m61_line);
+}
+void* operator new[](size_t sz, std::align_val_t align) {
+    return m61_aligned_alloc((size_t) align, sz, m61_file, m61_line);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    m61_free(ptr, m61_file, m61_line);
+}
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    m61_free(ptr, m61_file, m61_line);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    m61_free(ptr, m61_file, m61_line);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    m61_free(ptr, m61_file, m61_line);
+}
@@ -22,23 +22,60 @@ void m61_free(void* ptr, const char* file, long line);
 ///    should be initialized to zero.
 void* m61_calloc(size_t nmemb, size_t sz, const char* file, long line);
 
+/// m61_realloc(ptr, sz, file, line)
+///    Change the size of the allocation at `ptr` to `sz` bytes, keeping
+///    its contents, and return its new address.
+void* m61_realloc(void* ptr, size_t sz, const char* file, long line);
+
+/// m61_aligned_alloc(align, sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory
+///    aligned to `align`, which must be a power of two.
+void* m61_aligned_alloc(size_t align, size_t sz, const char* file, long line);
+
+/// m61_posix_memalign(ptr, align, sz, file, line)
+///    Like m61_aligned_alloc, but stores the pointer in `*ptr` and returns
+///    0, EINVAL, or ENOMEM.
+int m61_posix_memalign(void** ptr, size_t align, size_t sz, const char* file, long line);
+
+struct m61_shard;
+
 /// metadata
 ///    Per-allocation storage of memory metadata
 struct metadata {
     size_t size;                  // # size of memory chunk in bytes
-    size_t id;                    // unique id to prove it's metadata
-    long int unfreed;             // Set to 0 if freed, 12345 if unfreed
     char* file;                   // file of memory alloc call
+    m61_shard* owner;             // per-thread state of allocating thread
+    unsigned long long serial;    // owner's allocation count before this one
     int line;                     // line of memory alloc call
-    metadata* next;               // points to next metadata in linked list
-    metadata* last;               // points to last metadata in linked list
+    int unfreed;                  // Set to 0 if freed, 12345 if unfreed
+    short bucket;                 // profile bucket + 1, or 0 if not sampled
+    char aligned;                 // 1 if the payload was over-aligned
+    char guarded;                 // 1 if followed by a guard page
+    short site;                   // owner's heavy hitter counter, if still ours
+    short scope;                  // owner's scope depth at allocation, or 0
 };
 
-/// hhstruct
-///    Per-allocation storage of heavy hitter data
-struct hhstruct {
-  std::pair<const char*, long int> file_line;     // pair containing file and line
-  size_t size;                                    // size of allocation
+/// m61_nbuckets
+///    Number of buckets in m61 histograms. Bucket 0 counts zeros, bucket
+///    i counts values in [2^(i-1), 2^i), and the last bucket also counts
+///    all larger values.
+constexpr int m61_nbuckets = 40;
+
+/// hhcounter
+///    One monitored call site in the heavy hitter sketch
+struct hhcounter {
+    const char* file;                   // file of memory alloc call
+    long line;                          // line of memory alloc call
+    unsigned long long size;            // estimated bytes allocated here
+    unsigned long long error;           // max overestimate in `size`
+};
+
+/// m61_sitestatistics
+///    Histograms of one heavy hitting call site
+struct m61_sitestatistics {
+    hhcounter site;
+    unsigned long long size_hist[m61_nbuckets];     // allocation sizes
+    unsigned long long lifetime_hist[m61_nbuckets]; // see m61_statistics
 };
 
 /// m61_statistics
@@ -49,19 +86,45 @@ struct m61_statistics {
     unsigned long long ntotal;          // # total allocations
     unsigned long long total_size;      // # bytes in total allocations
     unsigned long long nfail;           // # failed allocation attempts
-    unsigned long long fail_size;       // # bytes in failed alloc attempts
+    unsigned long long fail_size;       // # bytes in failed alloc attempts;
+                                        // stops at ULLONG_MAX. A calloc
+                                        // whose size overflows counts only
+                                        // in `nfail`.
     char* heap_min;                     // smallest allocated addr
     char* heap_max;                     // largest allocated addr
+    unsigned long long size_hist[m61_nbuckets];     // allocation sizes
+    unsigned long long lifetime_hist[m61_nbuckets]; // allocations made by
+                                        // the allocating thread during the
+                                        // lifetime of each freed block
 };
 
 
+/// m61_scope_begin()
+///    Open a scope on the calling thread. Until the matching
+///    m61_scope_end, the thread's allocations belong to the scope. Scopes
+///    nest; returns the new scope's depth.
+int m61_scope_begin();
+
+/// m61_scope_end(file, line)
+///    Close the calling thread's innermost scope, freeing all of its
+///    allocations that are still active in one pass. The call was at
+///    location `file`:`line`.
+void m61_scope_end(const char* file, long line);
+
 /// m61_getstatistics(stats)
 ///    Store the current memory statistics in `*stats`.
 void m61_getstatistics(m61_statistics* stats);
 
-/// m61_printstatistics()
-///    Print the current memory statistics.
-void m61_printstatistics();
+/// m61_getsitestatistics(sites, nsites)
+///    Store up to `nsites` monitored call sites in `sites`, largest first,
+///    with their histograms. A site's histograms count only the time it
+///    was one of its thread's largest few sites. Returns the number stored.
+int m61_getsitestatistics(m61_sitestatistics* sites, int nsites);
+
+/// m61_printstatistics(detail)
+///    Print the current memory statistics. If `detail`, also print the
+///    histograms overall and for the top call sites.
+void m61_printstatistics(int detail = 0);
 
 /// m61_printleakreport()
 ///    Print a report of all currently-active allocated blocks of dynamic
@@ -72,10 +135,73 @@ void m61_printleakreport();
 ///    Print a report of heavy hitting memory allocations
 void hhreport();
 
+/// m61_metadata_outofline(is_enabled)
+///    If `is_enabled`, keep allocation metadata in a side table rather than
+///    in front of each payload. Must be called before the first allocation.
+void m61_metadata_outofline(int is_enabled);
+
+/// m61_guard_pages(rate)
+///    Place 1 in `rate` allocations at the end of their own pages, followed
+///    by an inaccessible guard page, so overflows fault immediately. 0
+///    turns guard pages off.
+void m61_guard_pages(unsigned rate);
+
+/// m61_profile_sample(rate)
+///    Sample allocations for the heap profiler, on average once every
+///    `rate` bytes. 0 turns sampling off.
+void m61_profile_sample(size_t rate);
+
+/// m61_profile_dump(f)
+///    Write the sampled allocation stacks to `f` as a pprof heap profile.
+void m61_profile_dump(FILE* f);
+
+/// m61_export_statistics(name)
+///    Publish the statistics of every thread in the POSIX shared memory
+///    object `name` (e.g. "/m61.1234") so `m61top` can watch them live.
+///    The object is removed at exit. Returns 0 on success, -1 on error.
+int m61_export_statistics(const char* name);
+
+/// m61_export_slot, m61_export_segment
+///    Layout of the exported statistics. Each thread owns one slot and
+///    updates it under a seqlock: `seq` is odd while an update is in
+///    progress, so readers retry until they see the same even value before
+///    and after copying the slot. `size_hist` is the thread's size
+///    histogram, with the buckets of m61_statistics. Threads beyond the
+///    first `m61_export_nslots` get no slot and are not exported, but
+///    `nslots` counts them.
+constexpr unsigned m61_export_magic = 0x6d36312e;
+constexpr int m61_export_nslots = 256;
+
+struct alignas(64) m61_export_slot {
+    unsigned long long seq;
+    unsigned long long nactive;
+    unsigned long long active_size;
+    unsigned long long ntotal;
+    unsigned long long total_size;
+    unsigned long long nfail;
+    unsigned long long fail_size;
+    unsigned long long size_hist[m61_nbuckets];
+};
+
+struct m61_export_segment {
+    unsigned magic;
+    unsigned nslots;                    // slots claimed; may exceed max
+    long pid;
+    uintptr_t heap_min;
+    uintptr_t heap_max;
+    m61_export_slot slots[m61_export_nslots];
+};
+
 /// `m61.cc` should use these functions rather than malloc() and free().
 void* base_malloc(size_t sz);
+void* base_calloc(size_t sz);
 void base_free(void* ptr);
+size_t base_usable_size(void* ptr);
 void base_allocate_disable(int is_disabled);
+void base_allocate_slab(int is_enabled);
+void* base_state_get();
+void* base_state_set(void* state);
+void base_state_orphan(void* state, int is_orphan);
 
 
 /// Override system versions with our versions.
@@ -83,6 +209,9 @@ void base_allocate_disable(int is_disabled);
 #define malloc(sz)          m61_malloc((sz), __FILE__, __LINE__)
 #define free(ptr)           m61_free((ptr), __FILE__, __LINE__)
 #define calloc(nmemb, sz)   m61_calloc((nmemb), (sz), __FILE__, __LINE__)
+#define realloc(ptr, sz)    m61_realloc((ptr), (sz), __FILE__, __LINE__)
+#define aligned_alloc(align, sz) m61_aligned_alloc((align), (sz), __FILE__, __LINE__)
+#define posix_memalign(ptr, align, sz) m61_posix_memalign((ptr), (align), (sz), __FILE__, __LINE__)
 #endif
 
 
@@ -120,7 +249,3 @@ inline constexpr bool operator!=(const system_allocator<T>&, const system_alloca
 
 #endif
 
-/// hh_vec
-///   Vector for creating heavy hitters report
-typedef std::vector<hhstruct, system_allocator<hhstruct>> hh_vec;
-
@@ -0,0 +1,142 @@
+#define M61_DISABLE 1
+#include "m61.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+// m61top: Watch the statistics that a process publishes with
+// m61_export_statistics(NAME). Reading never blocks or slows the
+// process: each per-thread slot is copied under its seqlock.
+
+/// read_slot(slot, copy)
+///    Copy a consistent snapshot of `slot` into `*copy`. Gives up on
+///    consistency if the writer seems to have died mid-update.
+static void read_slot(const m61_export_slot* slot, m61_export_slot* copy) {
+    const unsigned long long* src = (const unsigned long long*) slot;
+    unsigned long long* dst = (unsigned long long*) copy;
+    size_t nwords = sizeof(m61_export_slot) / sizeof(unsigned long long);
+    for (int tries = 0; tries != 100000; ++tries) {
+        unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq % 2 == 0) {
+            for (size_t i = 0; i != nwords; ++i) {
+                dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+                return;
+            }
+        }
+        sched_yield();
+    }
+}
+
+/// read_segment(seg, sum)
+///    Sum all claimed slots of `seg` into `*sum`; return the thread count.
+static unsigned read_segment(const m61_export_segment* seg, m61_export_slot* sum) {
+    memset(sum, 0, sizeof(*sum));
+    unsigned nslots = __atomic_load_n(&seg->nslots, __ATOMIC_RELAXED);
+    unsigned n = nslots < m61_export_nslots ? nslots : m61_export_nslots;
+    for (unsigned i = 0; i != n; ++i) {
+        m61_export_slot s;
+        read_slot(&seg->slots[i], &s);
+        sum->nactive += s.nactive;
+        sum->active_size += s.active_size;
+        sum->ntotal += s.ntotal;
+        sum->total_size += s.total_size;
+        sum->nfail += s.nfail;
+        if (__builtin_add_overflow(sum->fail_size, s.fail_size, &sum->fail_size)) {
+            sum->fail_size = ~0ULL;     // saturates, as in m61_getstatistics
+        }
+        for (int b = 0; b != m61_nbuckets; ++b) {
+            sum->size_hist[b] += s.size_hist[b];
+        }
+    }
+    return nslots;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "Usage: %s [-i SECONDS] [-n COUNT] NAME\n\
+  Print the statistics exported as NAME every SECONDS (default 1),\n\
+  COUNT times (default forever).\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    double interval = 1;
+    long count = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = strtod(optarg, nullptr);
+            break;
+        case 'n':
+            count = strtol(optarg, nullptr, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    const char* name = argv[optind];
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(name);
+        exit(1);
+    }
+    void* m = mmap(nullptr, sizeof(m61_export_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    const m61_export_segment* seg = (const m61_export_segment*) m;
+    if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != m61_export_magic) {
+        fprintf(stderr, "%s: not an m61 statistics segment\n", name);
+        exit(1);
+    }
+
+    unsigned long long last_ntotal = 0;
+    for (long iter = 0; iter != count; ++iter) {
+        if (iter != 0) {
+            usleep((useconds_t) (interval * 1e6));
+        }
+        m61_export_slot sum;
+        unsigned nthreads = read_segment(seg, &sum);
+
+        printf("%s: pid %ld, %u threads", name, seg->pid, nthreads);
+        if (nthreads > (unsigned) m61_export_nslots) {
+            printf(" (%u not shown)", nthreads - m61_export_nslots);
+        }
+        if (iter != 0) {
+            printf(", %.0f allocs/s", (sum.ntotal - last_ntotal) / interval);
+        }
+        printf("\n");
+        last_ntotal = sum.ntotal;
+        printf("alloc count: active %10llu   total %10llu   fail %10llu\n",
+               sum.nactive, sum.ntotal, sum.nfail);
+        printf("alloc size:  active %10llu   total %10llu   fail %10llu\n",
+               sum.active_size, sum.total_size, sum.fail_size);
+        printf("heap: %p - %p\n", (void*) __atomic_load_n(&seg->heap_min, __ATOMIC_RELAXED),
+               (void*) __atomic_load_n(&seg->heap_max, __ATOMIC_RELAXED));
+        for (int b = 0; b != m61_nbuckets; ++b) {
+            if (sum.size_hist[b]) {
+                unsigned long long lo = b ? 1ULL << (b - 1) : 0;
+                if (b == m61_nbuckets - 1) {
+                    printf("  size %12llu+             %12llu\n", lo, sum.size_hist[b]);
+                } else {
+                    printf("  size %12llu - %-12llu %12llu\n", lo, (1ULL << b) - 1, sum.size_hist[b]);
+                }
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+}
@@ -0,0 +1,152 @@
+#include "m61.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+// membench61: A multithreaded benchmark for the m61 allocator, modeled on
+// lectures/datarep6/membench.cc. Each thread repeatedly replaces entries
+// in an array of 4096 small allocations. With `-x`, every other
+// replacement happens in the next thread's array, so many blocks are
+// freed by a thread other than the one that allocated them.
+
+struct memnode {
+    const char* file;
+    unsigned line;
+};
+
+static const unsigned nnodes = 4096;
+static unsigned noperations;
+static int nthreads;
+static bool cross;
+static std::atomic<memnode*>* arrays[100];
+static std::atomic<unsigned long> answer;
+
+static memnode* memnode_alloc(unsigned line) {
+    memnode* m = (memnode*) malloc(sizeof(memnode));
+    m->file = "pset1/membench61.cc";
+    m->line = line;
+    return m;
+}
+
+static unsigned long memnode_benchmark(int t, unsigned step) {
+    assert(step % 2 == 1);  // `step` must be odd
+    std::atomic<memnode*>* mine = arrays[t];
+    std::atomic<memnode*>* theirs = arrays[(t + 1) % nthreads];
+    unsigned counter = nnodes;
+
+    // Replace one `noperations` times.
+    for (unsigned i = 0; i != noperations; ++i) {
+        unsigned pos = (i * step) % nnodes;
+        std::atomic<memnode*>* a = cross && (i & 1) ? theirs : mine;
+        memnode* old = a[pos].exchange(memnode_alloc(counter));
+        free(old);
+        ++counter;
+    }
+    return counter;
+}
+
+static void* benchmark_thread(void* user_data) {
+    int t = (int) (uintptr_t) user_data;
+    answer += memnode_benchmark(t, 2 * t + 1);
+    return nullptr;
+}
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    noperations = 10000000;
+    nthreads = 1;
+    bool use_base = false;
+    bool use_slab = false;
+    const char* export_name = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:j:xbpe:")) != -1) {
+        switch (opt) {
+        case 'n': {
+            char* end;
+            noperations = strtoul(optarg, &end, 0);
+            if (*end == 'm' || *end == 'M') {
+                noperations *= 1000000;
+            }
+            break;
+        }
+        case 'j':
+            nthreads = strtol(optarg, nullptr, 0);
+            break;
+        case 'x':
+            cross = true;
+            break;
+        case 'b':
+            use_base = true;
+            break;
+        case 'p':
+            use_slab = true;
+            break;
+        case 'e':
+            export_name = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n NOPS] [-j NTHREADS] [-x] [-b] [-p] [-e NAME]\n\
+  Default NOPS=%u, NTHREADS=1\n\
+  -x  free half of the blocks from a different thread\n\
+  -b  use the base allocator (default is the system allocator)\n\
+  -p  serve small blocks from the base allocator's size-class slabs\n\
+  -e  export statistics as shared memory object NAME for m61top\n",
+                    argv[0], noperations);
+            exit(1);
+        }
+    }
+    assert(nthreads >= 1 && nthreads <= 100);
+
+    // use the system allocator by default, like hhtest
+    base_allocate_disable(!use_base);
+    base_allocate_slab(use_slab);
+    if (export_name && m61_export_statistics(export_name) != 0) {
+        perror(export_name);
+        exit(1);
+    }
+
+    // Allocate 4096 memnodes per thread.
+    for (int t = 0; t != nthreads; ++t) {
+        arrays[t] = new std::atomic<memnode*>[nnodes];
+        for (unsigned i = 0; i != nnodes; ++i) {
+            arrays[t][i] = memnode_alloc(i);
+        }
+    }
+
+    // Run `nthreads` threads, each running the benchmark.
+    double start = now();
+    pthread_t threads[100];
+    for (int t = 0; t != nthreads; ++t) {
+        pthread_create(&threads[t], nullptr, benchmark_thread, (void*) (uintptr_t) t);
+    }
+    for (int t = 0; t != nthreads; ++t) {
+        pthread_join(threads[t], nullptr);
+    }
+    double elapsed = now() - start;
+
+    // Free everything and check that the statistics agree.
+    for (int t = 0; t != nthreads; ++t) {
+        for (unsigned i = 0; i != nnodes; ++i) {
+            free(arrays[t][i].load());
+        }
+        delete[] arrays[t];
+    }
+    m61_statistics stats;
+    m61_getstatistics(&stats);
+    assert(stats.nactive == 0 && stats.active_size == 0);
+
+    double nops = (double) noperations * nthreads;
+    printf("answer: %lu\n", answer.load());
+    printf("threads: %d  time: %.3f s  throughput: %.2f Mops/s  (%.2f Mops/s/thread)\n",
+           nthreads, elapsed, nops / elapsed / 1e6, nops / elapsed / 1e6 / nthreads);
+}
@@ -0,0 +1,23 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check for boundary write errors off the beginning of an allocated block,
+// with out-of-line metadata.
+
+int main() {
+    m61_metadata_outofline(1);
+    int* ptr = (int*) malloc(sizeof(int) * 10);
+    int* leak = (int*) malloc(sizeof(int) * 4);
+    for (int i = -1 /* Whoops! Should be 0 */; i < 10; ++i) {
+        ptr[i] = i;
+    }
+    free(ptr);
+    m61_printleakreport();
+    (void) leak;
+}
+
+//!!SORT
+//! LEAK CHECK: test???.cc:10: allocated object ??{\w+}?? with size 40
+//! LEAK CHECK: test???.cc:11: allocated object ??{\w+}?? with size 16
+//! MEMORY BUG???: detected wild write during free of pointer ???
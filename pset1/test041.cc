@@ -0,0 +1,32 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+// Check that guard pages catch boundary write errors immediately.
+
+static void segv_handler(int) {
+    const char msg[] = "guard page fault\n";
+    ssize_t n = write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    (void) n;
+    _exit(0);
+}
+
+int main() {
+    signal(SIGSEGV, segv_handler);
+    m61_guard_pages(1);
+    int* ptr = (int*) malloc(sizeof(int) * 10);
+    for (int i = 0; i < 10; ++i) {
+        ptr[i] = i;
+    }
+    printf("before\n");
+    fflush(stdout);
+    for (int i = 10; i < 100 /* Whoops! */; ++i) {
+        ptr[i] = i;
+    }
+    printf("after\n");
+}
+
+//! before
+//! guard page fault
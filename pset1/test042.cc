@@ -0,0 +1,43 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+// Check the sampling heap profiler: sampling once per byte records every
+// allocation, all from the same stack, while failed allocations and
+// invalid frees leave the profile alone. At a huge rate, a thread's first
+// allocation is not sampled.
+
+static void* worker(void*) {
+    free(malloc(100));
+    return nullptr;
+}
+
+int main() {
+    m61_profile_sample(1 << 30);
+    for (int i = 0; i != 10; ++i) {
+        pthread_t t;
+        pthread_create(&t, nullptr, worker, nullptr);
+        pthread_join(t, nullptr);
+    }
+
+    m61_profile_sample(1);
+    void* ptrs[10];
+    for (int i = 0; i != 10; ++i) {
+        ptrs[i] = malloc(100);
+    }
+    for (int i = 0; i != 5; ++i) {
+        free(ptrs[i]);
+    }
+    void* fail = malloc((size_t) -1 / 2);
+    assert(fail == nullptr);
+    free(ptrs[0]);
+    m61_profile_dump(stdout);
+}
+
+//! MEMORY BUG: test042.cc:34: invalid free of pointer ??{0x\w+}??, not allocated
+//! heap profile: 5: 500 [10: 1000] @ heap_v2/1
+//! 5: 500 [10: 1000] @ ???
+//! ???
+//! MAPPED_LIBRARIES:
+//! ???
@@ -0,0 +1,71 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+// Check statistics exported through shared memory, including those of a
+// thread that allocated before the export started and then went idle.
+
+static void* worker(void*) {
+    for (int i = 0; i != 3; ++i) {
+        void* p = malloc(64);
+        (void) p;
+    }
+    return nullptr;
+}
+
+int main() {
+    void* early = malloc(1000);
+    pthread_t t;
+    pthread_create(&t, nullptr, worker, nullptr);
+    pthread_join(t, nullptr);
+
+    char name[100];
+    snprintf(name, sizeof(name), "/m61test.%d", (int) getpid());
+    int r = m61_export_statistics(name);
+    assert(r == 0);
+
+    void* ptrs[10];
+    for (int i = 0; i != 10; ++i) {
+        ptrs[i] = malloc(i * 100);
+    }
+    for (int i = 0; i != 5; ++i) {
+        free(ptrs[i]);
+    }
+
+    // Read the segment the way m61top does
+    int fd = shm_open(name, O_RDONLY, 0);
+    assert(fd >= 0);
+    void* m = mmap(nullptr, sizeof(m61_export_segment), PROT_READ, MAP_SHARED, fd, 0);
+    assert(m != MAP_FAILED);
+    close(fd);
+    const m61_export_segment* seg = (const m61_export_segment*) m;
+    assert(seg->magic == m61_export_magic && seg->nslots == 2);
+    unsigned long long hist[m61_nbuckets] = {};
+    for (unsigned i = 0; i != seg->nslots; ++i) {
+        const m61_export_slot& slot = seg->slots[i];
+        assert(slot.seq % 2 == 0);
+        printf("active %llu/%llu total %llu/%llu\n", slot.nactive, slot.active_size,
+               slot.ntotal, slot.total_size);
+        for (int b = 0; b != m61_nbuckets; ++b) {
+            hist[b] += slot.size_hist[b];
+        }
+    }
+    for (int b = 0; b != m61_nbuckets; ++b) {
+        if (hist[b]) {
+            printf("bucket %d: %llu\n", b, hist[b]);
+        }
+    }
+    (void) early;
+}
+
+//! active 3/192 total 3/192
+//! active 6/4500 total 11/5500
+//! bucket 0: 1
+//! bucket 7: 4
+//! bucket 8: 1
+//! bucket 9: 3
+//! bucket 10: 5
@@ -0,0 +1,45 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check size and lifetime histograms, overall and by call site. Failed
+// allocations and invalid frees are not counted.
+
+int main() {
+    for (int i = 0; i != 10; ++i) {
+        void* p = malloc(100);
+        free(p);
+    }
+    void* a = malloc(1000);
+    void* b[3];
+    for (int i = 0; i != 3; ++i) {
+        b[i] = malloc(20);
+    }
+    free(a);
+    assert(malloc((size_t) -1 / 2) == nullptr);
+    free(a);
+    m61_printstatistics(1);
+    (void) b;
+}
+
+//! MEMORY BUG: test044.cc:20: invalid free of pointer ??{0x\w+}??, not allocated
+//! alloc count: active          3   total         14   fail          1
+//! alloc size:  active         60   total       2060   fail ??{\d+}??
+//! size histogram:
+//!             16 - 31                      3
+//!             64 - 127                    10
+//!            512 - 1023                    1
+//! lifetime histogram (allocations while live):
+//!              0 - 0                      10
+//!              2 - 3                       1
+//! test???.cc:10: size histogram:
+//!             64 - 127                    10
+//! test???.cc:10: lifetime histogram:
+//!              0 - 0                      10
+//! test???.cc:13: size histogram:
+//!            512 - 1023                    1
+//! test???.cc:13: lifetime histogram:
+//!              2 - 3                       1
+//! test???.cc:16: size histogram:
+//!             16 - 31                      3
+//! test???.cc:16: lifetime histogram:
@@ -0,0 +1,59 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+// Check realloc, aligned allocation with guard pages on every block, and
+// that invalid alignments fail without changing the statistics.
+
+static bool aligned_to(void* p, size_t align) {
+    return p && ((uintptr_t) p & (align - 1)) == 0;
+}
+
+int main() {
+    m61_guard_pages(1);
+
+    char* p = (char*) realloc(nullptr, 10);
+    strcpy(p, "realloc!");
+    p = (char*) realloc(p, 12);
+    assert(strcmp(p, "realloc!") == 0);
+    p = (char*) realloc(p, 100000);
+    assert(strcmp(p, "realloc!") == 0);
+    p = (char*) realloc(p, 4);
+    assert(memcmp(p, "real", 4) == 0);
+    free(p);
+
+    // Guarded payloads keep their alignment, up to the tail of a page
+    for (size_t align = 8; align <= 8192; align *= 2) {
+        for (size_t sz = 1; sz <= 100; sz += 33) {
+            void* q = aligned_alloc(align, sz);
+            assert(aligned_to(q, align));
+            memset(q, 1, sz);
+            void* r;
+            assert(posix_memalign(&r, align, sz) == 0 && aligned_to(r, align));
+            memset(r, 1, sz);
+            free(q);
+            free(r);
+        }
+    }
+    void* m = malloc(24);
+    assert(aligned_to(m, 16));
+    free(m);
+
+    m61_statistics before, after;
+    m61_getstatistics(&before);
+    void* r = &r;
+    assert(posix_memalign(&r, 0, 30) == EINVAL && r == &r);
+    assert(posix_memalign(&r, 4, 30) == EINVAL);
+    assert(posix_memalign(&r, 48, 30) == EINVAL);
+    m61_getstatistics(&after);
+    assert(after.nfail == before.nfail && after.ntotal == before.ntotal);
+
+    assert(aligned_alloc(0, 10) == nullptr);
+    assert(aligned_alloc(48, 10) == nullptr);
+    m61_printstatistics();
+    m61_printleakreport();
+}
+
+//! alloc count: active          0   total         93   fail          2
+//! ???
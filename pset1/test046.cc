@@ -0,0 +1,35 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check that m61_scope_end frees a scope's active allocations in one pass.
+
+int main() {
+    void* before = malloc(10);
+    int depth = m61_scope_begin();
+    assert(depth == 1);
+    for (int i = 0; i != 100; ++i) {
+        void* p = malloc(i);
+        if (i % 3 == 0) {
+            free(p);
+        }
+    }
+    assert(m61_scope_begin() == 2);
+    char* inner = (char*) malloc(16);
+    m61_scope_end(__FILE__, __LINE__);
+    char* wild = (char*) malloc(5);
+    wild[5] = 0;
+    m61_scope_end(__FILE__, __LINE__);
+    m61_scope_end(__FILE__, __LINE__);
+    (void) inner;
+    m61_printstatistics();
+    m61_printleakreport();
+    free(before);
+}
+
+//! MEMORY BUG: test046.cc:22: detected wild write during scope end of pointer ??{0x\w+}??
+//! MEMORY BUG: test046.cc:23: scope end without scope begin
+//! alloc count: active          2   total        103   fail          0
+//! ???
+//! LEAK CHECK: test046.cc:??{8|20}??: allocated object ??{0x\w+}?? with size ??{10|5}??
+//! LEAK CHECK: test046.cc:??{8|20}??: allocated object ??{0x\w+}?? with size ??{10|5}??
@@ -0,0 +1,33 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check the quarantine: writes to freed blocks are detected on eviction,
+// and freed large calloc mappings are not reused while quarantined, so a
+// double free of one is still caught.
+
+int main() {
+    char* p = (char*) malloc(100);
+    free(p);
+    p[10] = 'X';                // use after free
+    // evict it by freeing more than the quarantine holds
+    for (int i = 0; i != 20; ++i) {
+        free(malloc(1 << 20));
+    }
+    printf("done\n");
+
+    char* big = (char*) calloc(200000, 1);
+    free(big);
+    char* big2 = (char*) calloc(200000, 1);
+    printf("reused: %d\n", big2 == big);
+    big2[0] = 1;
+    free(big);
+    m61_printstatistics();
+}
+
+//! MEMORY BUG: write to freed block ??{0x\w+}?? detected ??{\d+}?? bytes into its ??{\d+}?? bytes
+//! done
+//! reused: 0
+//! MEMORY BUG: test047.cc:24: invalid free of pointer ??{0x\w+}??, not allocated
+//! alloc count: active          1   total         23   fail          0
+//! alloc size:  active     200000   total   ??{\d+}??   fail          0
@@ -0,0 +1,62 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check the slab backend: delayed reuse of freed blocks, the size class
+// table, usable sizes, and in-place realloc within a slab block.
+
+int main() {
+    base_allocate_slab(1);
+
+    // A freed block waits until more than 64 others of its class do
+    char* first = (char*) base_malloc(100);
+    base_free(first);
+    char* held[64];
+    int reused = 0;
+    for (int i = 0; i != 64; ++i) {
+        held[i] = (char*) base_malloc(100);
+        reused += held[i] == first;
+    }
+    printf("reused early: %d\n", reused);
+    for (int i = 0; i != 64; ++i) {
+        base_free(held[i]);
+    }
+    char* again = (char*) base_malloc(100);
+    printf("oldest reused next: %d\n", again == first);
+    base_free(again);
+
+    // Every size gets the smallest class that fits, 16-byte aligned
+    size_t last = 0;
+    for (size_t sz = 1; sz <= 2048; ++sz) {
+        void* p = base_malloc(sz);
+        size_t usable = base_usable_size(p);
+        assert(usable >= sz && ((uintptr_t) p & 15) == 0);
+        if (usable != last) {
+            printf("%s%zu", last ? " " : "", usable);
+            last = usable;
+        }
+        base_free(p);
+    }
+    printf("\n");
+    void* big = base_malloc(5000);
+    printf("not slab: %zu\n", base_usable_size(big));
+    base_free(big);
+
+    // m61 grows blocks in place within their class
+    char* p = (char*) malloc(10);
+    char* q = (char*) realloc(p, 20);
+    char* r = (char*) realloc(q, 3000);
+    printf("in place: %d, moved: %d\n", q == p, r != q);
+    free(r);
+    free(r);
+    m61_printstatistics();
+}
+
+//! reused early: 0
+//! oldest reused next: 1
+//! 16 32 48 64 80 96 112 128 160 192 224 256 320 384 448 512 640 768 1024 1280 1536 2048
+//! not slab: 5000
+//! in place: 1, moved: 1
+//! MEMORY BUG: test048.cc:51: invalid free of pointer ??{0x\w+}??, not allocated
+//! alloc count: active          0   total          3   fail          0
+//! alloc size:  active          0   total       3030   fail          0
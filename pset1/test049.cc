@@ -0,0 +1,41 @@
+#include <malloc.h>
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+// Check blocks freed after their allocating thread has exited: they are
+// released, not stranded, so a thread per task does not leak.
+
+static void* task(void*) {
+    char* big = (char*) malloc(1 << 20);
+    memset(big, 1, 1 << 20);
+    char** small = (char**) malloc(sizeof(char*));
+    *small = big;
+    return small;
+}
+
+int main() {
+    for (int i = 0; i != 200; ++i) {
+        pthread_t t;
+        void* result;
+        pthread_create(&t, nullptr, task, nullptr);
+        pthread_join(t, &result);
+        char** small = (char**) result;
+        free(*small);
+        free(small);
+    }
+
+    // The tasks' blocks were released, apart from a bounded quarantine
+    assert(mallinfo2().hblkhd < (64 << 20));
+    m61_statistics stats;
+    m61_getstatistics(&stats);
+    assert(stats.nactive == 0);
+    m61_printstatistics();
+    m61_printleakreport();
+    printf("done\n");
+}
+
+//! alloc count: active          0   total        400   fail          0
+//! alloc size:  active          0   total ??{\d+}??   fail          0
+//! done
@@ -0,0 +1,30 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check failed allocation sizes: a calloc whose size overflows counts as a
+// failure without a size, and `fail_size` saturates instead of wrapping.
+
+int main() {
+    void* p = calloc((size_t) -1 / 8 + 2, 16);
+    assert(p == nullptr);
+    p = malloc((size_t) -1 - 10);
+    assert(p == nullptr);
+
+    m61_statistics stats;
+    m61_getstatistics(&stats);
+    assert(stats.nfail == 2);
+    assert(stats.fail_size == (size_t) -1 - 10);
+
+    p = malloc((size_t) -1);
+    assert(p == nullptr);
+    p = malloc(100);
+    free(p);
+    m61_getstatistics(&stats);
+    assert(stats.nfail == 3);
+    assert(stats.fail_size == ~0ULL);
+    m61_printstatistics();
+}
+
+//! alloc count: active          0   total          1   fail          3
+//! alloc size:  active          0   total        100   fail ??{\d+}??
@@ -0,0 +1,27 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check that realloc grows a block in place while its base allocator
+// block has slack, so growing a byte at a time rarely copies.
+
+int main() {
+    char* p = (char*) malloc(1);
+    p[0] = 0;
+    int nmoves = 0;
+    for (size_t sz = 2; sz != 101; ++sz) {
+        char* q = (char*) realloc(p, sz);
+        nmoves += q != p;
+        q[sz - 1] = sz - 1;
+        p = q;
+    }
+    for (size_t i = 0; i != 100; ++i) {
+        assert(p[i] == (char) i);
+    }
+    assert(nmoves <= 8);
+    free(p);
+    m61_printstatistics();
+}
+
+//! alloc count: active          0   total ??{\d+}??   fail          0
+//! alloc size:  active          0   total ??{\d+}??   fail          0
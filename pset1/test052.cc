@@ -0,0 +1,46 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check that realloc changes the statistics the same way whether it
+// resizes in place or moves the block (as it must with guard pages).
+
+static bool resize(m61_statistics* delta) {
+    m61_statistics before, after;
+    m61_getstatistics(&before);
+    char* p = (char*) malloc(100);
+    char* q = (char*) realloc(p, 50);
+    char* r = (char*) realloc(q, 60);
+    m61_getstatistics(&after);
+    free(r);
+    delta->nactive = after.nactive - before.nactive;
+    delta->active_size = after.active_size - before.active_size;
+    delta->ntotal = after.ntotal - before.ntotal;
+    delta->total_size = after.total_size - before.total_size;
+    for (int b = 0; b != m61_nbuckets; ++b) {
+        delta->size_hist[b] = after.size_hist[b] - before.size_hist[b];
+        delta->lifetime_hist[b] = after.lifetime_hist[b] - before.lifetime_hist[b];
+    }
+    return p == q && q == r;
+}
+
+int main() {
+    m61_statistics in_place, moved;
+    assert(resize(&in_place));
+    m61_guard_pages(1);
+    assert(!resize(&moved));
+
+    assert(in_place.nactive == 1 && moved.nactive == 1);
+    assert(in_place.active_size == 60 && moved.active_size == 60);
+    assert(in_place.ntotal == 3 && moved.ntotal == 3);
+    assert(in_place.total_size == 210 && moved.total_size == 210);
+    for (int b = 0; b != m61_nbuckets; ++b) {
+        assert(in_place.size_hist[b] == moved.size_hist[b]);
+        assert(in_place.lifetime_hist[b] == moved.lifetime_hist[b]);
+    }
+    m61_printstatistics();
+    m61_printleakreport();
+}
+
+//! alloc count: active          0   total          6   fail          0
+//! alloc size:  active          0   total        420   fail          0
@@ -0,0 +1,38 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check a long-lived scope whose blocks are mostly freed one by one: the
+// blocks still active in each scope, and only those, are freed when it
+// ends, however often its list was compacted.
+
+int main() {
+    void* outside = malloc(10);
+    m61_scope_begin();
+    void* keep[100];
+    for (int i = 0; i != 100; ++i) {
+        keep[i] = malloc(i);
+        for (int j = 0; j != 1000; ++j) {
+            free(malloc(j % 64));
+        }
+    }
+    m61_scope_begin();
+    for (int i = 0; i != 5000; ++i) {
+        void* p = malloc(8);
+        if (i % 1000 != 0) {
+            free(p);
+        }
+    }
+    m61_scope_end(__FILE__, __LINE__);
+    m61_statistics stats;
+    m61_getstatistics(&stats);
+    assert(stats.nactive == 101);
+    free(keep[50]);
+    m61_scope_end(__FILE__, __LINE__);
+    m61_getstatistics(&stats);
+    assert(stats.nactive == 1);
+    m61_printleakreport();
+    free(outside);
+}
+
+//! LEAK CHECK: test053.cc:10: allocated object ??{0x\w+}?? with size 10
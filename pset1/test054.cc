@@ -0,0 +1,26 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+// Check that a write to a freed block is reported at exit even when the
+// block was freed, and written, by a thread that has since exited.
+
+static void* worker(void*) {
+    char* p = (char*) malloc(100);
+    free(p);
+    p[10] = 'X';                // use after free
+    return nullptr;
+}
+
+int main() {
+    void* mine = malloc(10);
+    pthread_t t;
+    pthread_create(&t, nullptr, worker, nullptr);
+    pthread_join(t, nullptr);
+    free(mine);
+    printf("done\n");
+}
+
+//! done
+//! MEMORY BUG: write to freed block ??{0x\w+}?? detected ??{\d+}?? bytes into its ??{\d+}?? bytes
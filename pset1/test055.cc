@@ -0,0 +1,29 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+// Check that realloc to a size near SIZE_MAX fails, leaving the block
+// valid and unchanged, instead of resizing it in place.
+
+int main() {
+    char* p = (char*) malloc(100);
+    strcpy(p, "realloc!");
+    for (size_t k = 0; k <= 4096; k += 1024) {
+        m61_statistics before, after;
+        m61_getstatistics(&before);
+        assert(realloc(p, SIZE_MAX - k) == nullptr);
+        m61_getstatistics(&after);
+        assert(after.nfail == before.nfail + 1);
+        assert(after.active_size == before.active_size);
+        assert(strcmp(p, "realloc!") == 0);
+    }
+    p = (char*) realloc(p, 200);
+    assert(strcmp(p, "realloc!") == 0);
+    free(p);
+    m61_printstatistics();
+    m61_printleakreport();
+}
+
+//! alloc count: active          0   total          2   fail          5
+//! alloc size:  active          0   total        300   fail        ???
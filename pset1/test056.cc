@@ -0,0 +1,31 @@
+#include "m61.hh"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Check that freed blocks larger than the whole quarantine are not reused
+// while quarantined, so a double free of one is still caught.
+
+int main() {
+    const size_t sz = 9 << 20;
+    char* big = (char*) calloc(sz, 1);
+    free(big);
+    char* big2 = (char*) calloc(sz, 1);
+    printf("calloc reused: %d\n", big2 == big);
+    big2[0] = 1;
+    free(big);
+
+    char* m = (char*) malloc(sz);
+    free(m);
+    char* m2 = (char*) malloc(sz);
+    printf("malloc reused: %d\n", m2 == m);
+    memset(m2, 1, sz);
+    free(m);
+    m61_printstatistics();
+}
+
+//! calloc reused: 0
+//! MEMORY BUG: test056.cc:15: invalid free of pointer ??{0x\w+}??, not allocated
+//! malloc reused: 0
+//! MEMORY BUG: test056.cc:22: invalid free of pointer ??{0x\w+}??, not allocated
+//! alloc count: active          2   total          4   fail          0
+//! alloc size:  active   18874368   total   37748736   fail          0
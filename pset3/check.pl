@@ -830,6 +830,55 @@ enqueue(31,
     "redirected large file, 1B-4KB block I/O, sequential");
 
 
+# WHOLE-FILE COPIES
+
+enqueue(32,
+    "./copy61 -o files/out.txt files/text20meg.txt",
+    "regular large file, whole-file copy");
+
+enqueue(33,
+    "./copy61 files/text20meg.txt | cat > files/out.txt",
+    "regular large file to pipe, whole-file copy");
+
+enqueue(34,
+    "cat files/text20meg.txt | ./copy61 -o files/out.txt",
+    "piped large file, whole-file copy");
+
+enqueue(35,
+    "./copy61 -s 5242880 -o files/out.txt /dev/zero",
+    "magic zero file, whole-file copy");
+
+
+# VECTORED I/O
+
+enqueue(36,
+    "./scattergather61 -v -b 509 -o files/out1.txt -o files/out2.txt -o files/out3.txt -o files/out4.txt -i files/text1meg.txt -i files/text90k-rev.txt -i files/text1meg.txt",
+    "scatter/gather 4/3 files, 509B vectored I/O");
+
+enqueue(37,
+    "./scattergather61 -v -b 3 -o files/out1.txt -o files/out2.txt -i files/text90k-rev.txt -i files/binary1meg.bin",
+    "scatter/gather 2/2 files, 3B vectored I/O");
+
+enqueue(38,
+    "./scattergather61 -v -b 300000 -o files/out1.txt -o files/out2.txt -i files/text5meg.txt -i files/text90k-rev.txt",
+    "scatter/gather 2/2 files, 300KB vectored I/O");
+
+enqueue(39,
+    "cat files/text5meg.txt | ./scattergather61 -v -b 65536 -o files/out1.txt -o files/out2.txt -o files/out3.txt",
+    "scattered piped file, 64KB vectored I/O");
+
+enqueue(40,
+    "./scattergather61 -v -b 4099 -i files/text1meg.txt -i files/text90k-rev.txt | cat > files/out.txt",
+    "gathered files to pipe, 4099B vectored I/O");
+
+
+# WRITE ERRORS
+
+enqueue(41,
+    "./copy61 -b 100 -o /dev/full files/text1meg.txt 2> files/out.txt",
+    "regular small file to full device, buffered then whole-file copy");
+
+
 run($sequentially);
 
 summary();
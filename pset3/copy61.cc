@@ -0,0 +1,38 @@
+#include "io61.hh"
+#include <algorithm>
+
+// Usage: ./copy61 [-s SIZE] [-b BLOCKSIZE] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE with io61_copy, which moves the
+//    data inside the kernel where it can. With `-b`, the first BLOCKSIZE
+//    bytes go through io61_read and io61_write first, so OUTFILE holds
+//    buffered data when io61_copy starts. Reports a failed copy on
+//    standard error.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "s:b:o:i:");
+    size_t size = args.input_size;
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    if (args.block_size) {
+        char* buf = new char[args.block_size];
+        ssize_t n = io61_read(inf, buf, std::min(args.block_size, size));
+        if (n > 0) {
+            io61_write(outf, buf, n);
+            size -= n;
+        }
+        delete[] buf;
+    }
+    bool ok = io61_copy(inf, outf, size) >= 0;
+
+    io61_close(inf);
+    ok = io61_close(outf) == 0 && ok;
+    io61_profile_end();
+    if (!ok) {
+        fprintf(stderr, "copy61: copy failed\n");
+    }
+}
@@ -3,21 +3,76 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
 
 constexpr off_t BUFSIZE = 4096;
+constexpr off_t MAXBUFSIZE = 256 << 10; // cache size limit for sequential I/O
+constexpr off_t PIPEBUFSIZE = 4 * MAXBUFSIZE; // input a pipe-mode reader absorbs
+constexpr off_t ADVISESIZE = 64 << 10;  // cache size that triggers readahead advice
+constexpr off_t MAPWINDOW = 64 << 20;  // largest file mapping window
+constexpr off_t PENDINGSIZE = 1 << 20;   // pending write bytes that force a flush
+constexpr size_t PENDINGEXTENTS = 16384; // pending write extents that force a flush
+constexpr int NSLOTS = 64;  // blocks in the slot cache of a seeking writer
+constexpr int SLOTWAYS = 16; // slot cache associativity
+
+// io61_slot: one BUFSIZE-aligned block held by a seeking writer, and the
+// range of it that was written
+struct io61_slot {
+    off_t off = -1;         // file offset of the block, -1 if unused
+    off_t lo = 0;           // dirty bytes are [off + lo, off + hi)
+    off_t hi = 0;
+    unsigned long used = 0; // LRU stamp
+};
+
+// io61_pending: bytes written by a seeking writer and not yet written to
+// the file. Recent blocks live in the slot cache; dirty ranges the slots
+// give up join `extents`, keyed by file offset. Extents never overlap or
+// touch (see io61_pend), and where a slot and an extent overlap, the
+// slot's bytes are newer.
+struct io61_pending {
+    io61_slot slot[NSLOTS];
+    unsigned long clock = 0;
+    unsigned char data[NSLOTS * BUFSIZE];   // BUFSIZE bytes per slot
+    std::map<off_t, std::string> extents;
+    off_t size = 0;         // total bytes in `extents`
+};
 
 struct io61_file {
     int fd;
-    off_t bufsize = BUFSIZE; // or whatever
-    unsigned char cbuf[BUFSIZE];
-    off_t tag;      // file offset of first byte in cache (0 when file is opened)
-    off_t end_tag;  // file offset one past last valid byte in cache
-    off_t pos_tag;  // file offset of next char to read in cache
-    int mode;       // read or write (no read/write)
-    bool is_dirty;  // tracks whether a write file is dirty or clean
+    off_t bufsize = BUFSIZE;    // cache size in use; see io61_adapt
+    off_t bufcap = BUFSIZE;     // allocated size of `buf`
+    unsigned char* buf = new unsigned char[BUFSIZE];
+    unsigned char* cbuf = buf;  // cache: `buf`, or the mapping window
+    bool seeked = false;        // seeked since the last refill or flush;
+                                // if mapped, jumped to the window
+    bool advised = false;       // sequential readahead advice given
+    size_t map_size = 0;        // size of mapping window, 0 if not mapped
+    bool map_tried = false;     // set once io61_map has been called
+    bool pipemode = false;      // set by io61_pipemode
+    off_t tag = 0;      // file offset of first byte in cache (0 when file is opened)
+    off_t end_tag = 0;  // file offset one past last valid byte in cache
+    off_t pos_tag = 0;  // file offset of next char to read in cache
+    int mode;           // read or write (no read/write)
+    bool is_dirty = false;  // tracks whether a write file is dirty or clean
+    bool pipe_eof = false;  // pipe mode: end of file seen while absorbing
+    bool pipe_nowait = true; // pipe mode: reads can be made nonblocking
+    bool peeking = false;   // pipe mode: bytes from io61_peek may be in use
+    off_t last_seek = 0;    // target of the last read-mode seek
+    io61_pending* pending = nullptr; // pending writes, once a writer seeks
 };
 
 
+// pipe_files: the open files in pipe mode; see io61_pipemode.
+static std::vector<io61_file*> pipe_files;
+
+
 // io61_fdopen(fd, mode)
 //    Return a new io61_file for file descriptor `fd`. `mode` is
 //    either O_RDONLY for a read-only file or O_WRONLY for a
@@ -32,27 +87,577 @@ io61_file* io61_fdopen(int fd, int mode) {
 }
 
 
-// io61_close(f)
+// io61_pipemode(f)
+//    Put `f`, normally a pipe or socket carrying a request/response
+//    protocol, in pipe mode. Reads from a pipe-mode file return as soon
+//    as some bytes have arrived, rather than waiting for all `sz`. Before
+//    such a read would block, every pipe-mode writer is flushed; and
+//    while a pipe-mode writer waits for room, input arriving on pipe-mode
+//    readers is pulled into their caches, up to PIPEBUFSIZE bytes each,
+//    so two processes that both write before reading cannot deadlock on
+//    full pipes. A reader whose peeked bytes have not been consumed is
+//    skipped, so they stay valid. Returns 0.
+
+int io61_pipemode(io61_file* f) {
+    if (!f->pipemode) {
+        f->pipemode = true;
+        pipe_files.push_back(f);
+    }
+    return 0;
+}
+
+
+// io61_pipe_ready(f)
+//    Return true if a read from `f` would not block.
+
+static bool io61_pipe_ready(io61_file* f) {
+    pollfd p = {f->fd, POLLIN, 0};
+    return poll(&p, 1, 0) != 0;
+}
+
+
+// io61_pipe_full(f)
+//    Return true if the pipe-mode reader `f` has absorbed all the input
+//    it may hold.
+
+static bool io61_pipe_full(io61_file* f) {
+    return f->end_tag - f->pos_tag >= PIPEBUFSIZE;
+}
+
+
+// io61_absorb(f, flags)
+//    Read what input is available on the pipe-mode reader `f` into its
+//    cache, growing the cache if it is full, up to PIPEBUFSIZE. The read
+//    is made with preadv2 `flags`; RWF_NOWAIT makes it fail with EAGAIN
+//    instead of blocking. Returns the number of bytes read, 0 at end of
+//    file, or -1 on error or if `f` is full.
+
+static ssize_t io61_absorb(io61_file* f, int flags) {
+    off_t keep = f->end_tag - f->pos_tag;
+    if (keep == f->bufcap) {
+        if (io61_pipe_full(f)) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        unsigned char* nbuf = new unsigned char[2 * f->bufcap];
+        memcpy(nbuf, &f->cbuf[f->pos_tag - f->tag], keep);
+        delete[] f->buf;
+        f->buf = f->cbuf = nbuf;
+        f->bufcap *= 2;
+    } else if (keep > 0 && f->pos_tag != f->tag) {
+        memmove(f->cbuf, &f->cbuf[f->pos_tag - f->tag], keep);
+    }
+    f->tag = f->pos_tag;
+    iovec iov = {&f->cbuf[keep], (size_t) (f->bufcap - keep)};
+    ssize_t n = preadv2(f->fd, &iov, 1, -1, flags);
+    if (n > 0) {
+        f->end_tag += n;
+        f->bufsize = std::max(f->bufsize, f->end_tag - f->pos_tag);
+    } else if (n == 0 || (errno != EINTR && errno != EAGAIN
+                          && errno != EOPNOTSUPP)) {
+        f->pipe_eof = true;
+    }
+    return n;
+}
+
+
+// io61_pipe_poll(f, events)
+//    Block until `f` is ready for `events`, absorbing input that arrives
+//    meanwhile on the other pipe-mode readers. Readers that are full are
+//    not polled, so a peer that floods us waits until we read. Nor are
+//    readers whose peeked bytes may be in use, since absorbing moves
+//    their caches.
+
+static void io61_pipe_poll(io61_file* f, short events) {
+    std::vector<pollfd> pfds;
+    std::vector<io61_file*> inputs;
+    while (true) {
+        pfds.assign(1, pollfd{f->fd, events, 0});
+        inputs.clear();
+        for (io61_file* g : pipe_files) {
+            if (g != f && g->mode == O_RDONLY && !g->pipe_eof
+                && !io61_pipe_full(g) && !g->peeking) {
+                pfds.push_back(pollfd{g->fd, POLLIN, 0});
+                inputs.push_back(g);
+            }
+        }
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        for (size_t i = 0; i != inputs.size(); ++i) {
+            if (pfds[i + 1].revents) {
+                io61_absorb(inputs[i], 0);
+            }
+        }
+        if (pfds[0].revents) {
+            return;
+        }
+    }
+}
+
+
+// io61_pipe_fill(f, block)
+//    Read available input on the pipe-mode reader `f` into its cache.
+//    The first read is nonblocking, so input already waiting costs one
+//    system call. If none is waiting and `block` is false, returns -1
+//    with errno EAGAIN. Otherwise, the pipe-mode writers are flushed,
+//    since their peers may be waiting for that output before sending
+//    ours, and then `f` waits for input. Descriptors that do not support
+//    nonblocking reads are polled first instead. Returns the number of
+//    bytes added to the cache, 0 at end of file, or -1 on error.
+
+static ssize_t io61_pipe_fill(io61_file* f, bool block) {
+    f->peeking = false;
+    while (true) {
+        if (f->pipe_nowait) {
+            ssize_t n = io61_absorb(f, RWF_NOWAIT);
+            if (n >= 0 || (errno != EAGAIN && errno != EOPNOTSUPP
+                           && errno != EINTR)) {
+                return n;
+            } else if (errno == EOPNOTSUPP) {
+                f->pipe_nowait = false;
+            }
+        }
+        if (!f->pipe_nowait && io61_pipe_ready(f)) {
+            return io61_absorb(f, 0);
+        } else if (!block) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        off_t end_tag = f->end_tag;
+        for (io61_file* g : pipe_files) {
+            if (g->mode != O_RDONLY) {
+                io61_flush(g);
+            }
+        }
+        if (f->end_tag != end_tag) {
+            return f->end_tag - end_tag;
+        }
+        io61_pipe_poll(f, POLLIN);
+    }
+}
+
+
+// io61_pipe_write(f)
+//    Flush the pipe-mode writer `f`. While other pipe-mode readers are
+//    open, the cache goes out in PIPE_BUF pieces, each written only once
+//    poll says it fits, so input can be absorbed between them. Otherwise
+//    a nonblocking `f` that is full is polled before retrying. Returns
+//    the number of bytes written or -1 on error.
+
+static ssize_t io61_pipe_write(io61_file* f) {
+    off_t len = f->pos_tag - f->tag;
+    off_t done = 0;
+    bool inputs = std::any_of(pipe_files.begin(), pipe_files.end(),
+                              [] (io61_file* g) {
+                                  return g->mode == O_RDONLY && !g->pipe_eof;
+                              });
+    while (done != len) {
+        off_t ch = len - done;
+        if (inputs) {
+            io61_pipe_poll(f, POLLOUT);
+            ch = std::min(ch, (off_t) PIPE_BUF);
+        }
+        ssize_t w = write(f->fd, &f->cbuf[done], ch);
+        if (w > 0) {
+            done += w;
+        } else if (w == 0 || (errno != EINTR && errno != EAGAIN)) {
+            break;
+        } else if (errno == EAGAIN && !inputs) {
+            io61_pipe_poll(f, POLLOUT);
+        }
+    }
+    f->tag = f->pos_tag;
+    f->is_dirty = false;
+    return done == len ? len : -1;
+}
+
+
+// io61_adapt(f)
+//    Size the cache of `f` for its access pattern before a refill or a
+//    flush of a full cache. If the cache was used sequentially since the
+//    last refill or flush, its size doubles, up to MAXBUFSIZE, so long
+//    streams take few system calls; once a read cache is large, the
+//    kernel is advised to read ahead. After a seek outside the cache,
+//    which marks strided or random access, the cache shrinks back to
+//    BUFSIZE so no bandwidth is wasted on unread data. Unread bytes are
+//    kept. Does nothing for mapped files.
+
+static void io61_adapt(io61_file* f) {
+    if (f->map_size) {
+        return;
+    }
+    if (f->seeked) {
+        f->seeked = false;
+        f->bufsize = BUFSIZE;
+        if (f->advised) {
+            posix_fadvise(f->fd, 0, 0, POSIX_FADV_NORMAL);
+            f->advised = false;
+        }
+        return;
+    }
+    if (f->bufsize >= MAXBUFSIZE) {
+        return;
+    }
+    f->bufsize *= 2;
+    if (f->bufsize > f->bufcap) {
+        // move the cached bytes still needed to a larger buffer
+        unsigned char* nbuf = new unsigned char[f->bufsize];
+        off_t first = f->mode == O_RDONLY ? f->pos_tag : f->tag;
+        memcpy(nbuf, &f->cbuf[first - f->tag], f->end_tag - first);
+        delete[] f->buf;
+        f->buf = f->cbuf = nbuf;
+        f->bufcap = f->bufsize;
+        f->tag = first;
+    }
+    if (f->mode == O_RDONLY && !f->advised && f->bufsize >= ADVISESIZE) {
+        posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        f->advised = true;
+    }
+}
+
+
+// io61_unmap(f)
+//    Stop mapping `f`: its cache is `buf` again, empty at `pos_tag`, and
+//    later reads use read() from there. Does nothing if `f` is not mapped.
+
+static void io61_unmap(io61_file* f) {
+    if (!f->map_size) {
+        return;
+    }
+    munmap(f->cbuf, f->map_size);
+    f->map_size = 0;
+    f->cbuf = f->buf;
+    f->bufsize = BUFSIZE;
+    f->tag = f->end_tag = f->pos_tag;
+    lseek(f->fd, f->pos_tag, SEEK_SET);
+}
+
+
+// io61_map(f, pos)
+//    Map a window of the regular file `f`, opened for reading, around
+//    file offset `pos`, replacing any earlier window; the window is the
+//    cache, so reads and seeks inside it need no system calls. A file of
+//    up to MAPWINDOW bytes is mapped whole. In a larger one, the window
+//    holds at most MAPWINDOW bytes and starts a quarter to half a window
+//    before `pos`, leaving room for scans in either direction; io61_fill
+//    and io61_seek slide it. Pages are faulted in as they are read, not
+//    populated up front. First called on the first seek: sequential reads
+//    are as fast through read(), which avoids the cost of mapping.
+//    Returns false if `f` cannot be mapped; then `f` is unmapped as by
+//    io61_unmap.
+
+static bool io61_map(io61_file* f, off_t pos) {
+    f->map_tried = true;
+    off_t size = io61_filesize(f);
+    off_t start = 0;
+    if (size > MAPWINDOW) {
+        start = std::max(std::min(pos, size) / (MAPWINDOW / 4) * (MAPWINDOW / 4)
+                         - MAPWINDOW / 4, (off_t) 0);
+    }
+    off_t len = std::min(size - start, MAPWINDOW);
+    if (f->map_size && start == f->tag && len == (off_t) f->map_size) {
+        return true;
+    }
+    void* m = size > 0
+        ? mmap(nullptr, len, PROT_READ, MAP_PRIVATE, f->fd, start) : MAP_FAILED;
+    if (m == MAP_FAILED) {
+        io61_unmap(f);
+        return false;
+    }
+    if (f->map_size) {
+        munmap(f->cbuf, f->map_size);
+    }
+    f->cbuf = (unsigned char*) m;
+    f->map_size = len;
+    f->bufsize = len;
+    f->tag = start;
+    f->end_tag = start + len;
+    f->pos_tag = std::min(std::max(f->pos_tag, f->tag), f->end_tag);
+    return true;
+}
+
+
+// io61_slide(f, pos)
+//    Move the mapping window of `f` to `pos`, which lies outside it, for
+//    a seek. A seek that continues a scan right past the window slides
+//    it, and so does a single jump away. A second jump in a row marks
+//    random access over a file larger than the window, which would remap
+//    on nearly every seek, so `f` is unmapped instead and later reads use
+//    read(). Returns true if `f` is still mapped.
+
+static bool io61_slide(io61_file* f, off_t pos) {
+    bool jump = pos != f->tag - 1 && pos != f->end_tag;
+    if (jump && f->seeked) {
+        io61_unmap(f);
+        return false;
+    }
+    f->seeked = jump;
+    return io61_map(f, pos);
+}
+
+
+// io61_pend(f, off, data, n)
+//    Add the `n` bytes at `data`, written at file offset `off`, to the
+//    pending extents of seeking writer `f`. Extents the new bytes overlap
+//    or touch merge with them into one; the new bytes win.
+
+static void io61_pend(io61_file* f, off_t off, const unsigned char* data,
+                      off_t n) {
+    auto& extents = f->pending->extents;
+    auto it = extents.upper_bound(off);
+    if (it != extents.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + (off_t) prev->second.size() >= off) {
+            it = prev;
+        }
+    }
+    // find the extents [it, last) to merge, and the merged range
+    off_t start = it == extents.end() ? off : std::min(off, it->first);
+    off_t stop = off + n;
+    auto last = it;
+    for (; last != extents.end() && last->first <= stop; ++last) {
+        stop = std::max(stop, last->first + (off_t) last->second.size());
+        f->pending->size -= last->second.size();
+    }
+    f->pending->size += stop - start;
+
+    if (it != last && it->first == start) {
+        // grow the first extent in place, which is cheap when appending
+        std::string& s = it->second;
+        s.resize(stop - start);
+        for (auto x = std::next(it); x != last; ++x) {
+            memcpy(&s[x->first - start], x->second.data(), x->second.size());
+        }
+        memcpy(&s[off - start], data, n);
+        extents.erase(std::next(it), last);
+    } else {
+        std::string s(stop - start, '\0');
+        for (auto x = it; x != last; ++x) {
+            memcpy(&s[x->first - start], x->second.data(), x->second.size());
+        }
+        memcpy(&s[off - start], data, n);
+        extents.erase(it, last);
+        extents.emplace_hint(last, start, std::move(s));
+    }
+}
+
+
+// io61_pending_flush(f)
+//    Write and forget all pending extents of `f`, in file order.
+
+static int io61_pending_flush(io61_file* f) {
+    int r = 0;
+    for (auto& [off, data] : f->pending->extents) {
+        if (pwrite(f->fd, data.data(), data.size(), off) < 0) {
+            r = -1;
+        }
+    }
+    f->pending->extents.clear();
+    f->pending->size = 0;
+    return r;
+}
+
+
+// io61_slot_data(f, s)
+//    Return the data of the block held in slot `s` of `f`.
+
+static inline unsigned char* io61_slot_data(io61_file* f, io61_slot* s) {
+    return &f->pending->data[(s - f->pending->slot) * BUFSIZE];
+}
+
+
+// io61_slot_pend(f, s)
+//    Move the dirty bytes of slot `s` of `f` to the pending extents and
+//    mark it clean.
+
+static void io61_slot_pend(io61_file* f, io61_slot* s) {
+    io61_pend(f, s->off + s->lo, io61_slot_data(f, s) + s->lo, s->hi - s->lo);
+    s->lo = s->hi = 0;
+}
+
+
+// io61_slot_find(f, block)
+//    Return the slot of `f` holding the block at file offset `block`.
+//    On a miss, the least recently used slot of the block's set gives its
+//    dirty bytes to the pending extents and is reassigned. Block numbers
+//    are hashed to sets, so power-of-two strides do not all land in one
+//    set.
+
+static io61_slot* io61_slot_find(io61_file* f, off_t block) {
+    unsigned long h = (unsigned long) (block / BUFSIZE) * 0x9E3779B97F4A7C15UL;
+    io61_slot* set = &f->pending->slot[(h >> 32) % (NSLOTS / SLOTWAYS) * SLOTWAYS];
+    io61_slot* s = set;
+    for (int i = 0; i != SLOTWAYS && s->off != block; ++i) {
+        if (set[i].off == block || set[i].used < s->used) {
+            s = &set[i];
+        }
+    }
+    if (s->off != block) {
+        if (s->hi > s->lo) {
+            io61_slot_pend(f, s);
+        }
+        s->off = block;
+    }
+    s->used = ++f->pending->clock;
+    return s;
+}
+
+
+// io61_slot_flush(f)
+//    Write all dirty slots of `f`, in file order. Dirty ranges that
+//    continue one another are coalesced into a single pwritev.
+
+static int io61_slot_flush(io61_file* f) {
+    io61_slot* dirty[NSLOTS];
+    int n = 0;
+    for (int i = 0; i != NSLOTS; ++i) {
+        if (f->pending->slot[i].hi > f->pending->slot[i].lo) {
+            dirty[n++] = &f->pending->slot[i];
+        }
+    }
+    std::sort(dirty, dirty + n, [] (io61_slot* a, io61_slot* b) {
+        return a->off < b->off;
+    });
+    int r = 0;
+    for (int i = 0; i != n; ) {
+        iovec iov[NSLOTS];
+        int j = i;
+        do {
+            io61_slot* s = dirty[j];
+            iov[j - i].iov_base = io61_slot_data(f, s) + s->lo;
+            iov[j - i].iov_len = s->hi - s->lo;
+            ++j;
+        } while (j != n && dirty[j - 1]->hi == BUFSIZE && dirty[j]->lo == 0
+                 && dirty[j]->off == dirty[j - 1]->off + BUFSIZE);
+        if (pwritev(f->fd, iov, j - i, dirty[i]->off + dirty[i]->lo) < 0) {
+            r = -1;
+        }
+        for (; i != j; ++i) {
+            dirty[i]->lo = dirty[i]->hi = 0;
+        }
+    }
+    return r;
+}
+
+
+// io61_stash(f)
+//    Empty the write cache of seeking writer `f`, which then restarts at
+//    `pos_tag`. Bytes written since the last seek move to the slots,
+//    block by block, where later seeks can return to them. A slot whose
+//    dirty range cannot be extended over the new bytes, or that is
+//    evicted, gives its dirty bytes to the pending extents, which are
+//    written once they grow past PENDINGSIZE bytes or PENDINGEXTENTS
+//    extents. A cache larger than a block, which holds a sequential run,
+//    goes straight to the file after any extents and slots it overlaps.
+
+static int io61_stash(io61_file* f) {
+    int r = 0;
+    if (f->end_tag - f->tag > BUFSIZE) {
+        // slots join the extents first, where their newer bytes win
+        for (int i = 0; i != NSLOTS; ++i) {
+            io61_slot* s = &f->pending->slot[i];
+            if (s->hi > s->lo && s->off + s->lo < f->end_tag
+                && s->off + s->hi > f->tag) {
+                io61_slot_pend(f, s);
+            }
+        }
+        auto& extents = f->pending->extents;
+        auto it = extents.upper_bound(f->tag);
+        if (it != extents.begin()
+            && std::prev(it)->first + (off_t) std::prev(it)->second.size() > f->tag) {
+            --it;
+        }
+        while (it != extents.end() && it->first < f->end_tag) {
+            if (pwrite(f->fd, it->second.data(), it->second.size(), it->first) < 0) {
+                r = -1;
+            }
+            f->pending->size -= it->second.size();
+            it = extents.erase(it);
+        }
+        if (pwrite(f->fd, f->cbuf, f->end_tag - f->tag, f->tag) < 0) {
+            r = -1;
+        }
+    } else {
+        for (off_t p = f->tag; p != f->end_tag; ) {
+            off_t block = p - p % BUFSIZE;
+            off_t lo = p - block;
+            off_t hi = std::min(f->end_tag - block, BUFSIZE);
+            io61_slot* s = io61_slot_find(f, block);
+            if (s->hi > s->lo && (hi < s->lo || lo > s->hi)) {
+                io61_slot_pend(f, s);
+            }
+            memcpy(io61_slot_data(f, s) + lo, &f->cbuf[p - f->tag], hi - lo);
+            if (s->hi > s->lo) {
+                s->lo = std::min(s->lo, lo);
+                s->hi = std::max(s->hi, hi);
+            } else {
+                s->lo = lo;
+                s->hi = hi;
+            }
+            p = block + hi;
+        }
+        if (f->pending->size > PENDINGSIZE
+            || f->pending->extents.size() > PENDINGEXTENTS) {
+            r = io61_pending_flush(f);
+        }
+    }
+    f->tag = f->pos_tag = f->end_tag;
+    f->is_dirty = false;
+    return r;
+}
+
+
+// io61_fill(f)
 //    Fill the read cache with new data, starting from file offset `end_tag`.
-//    Only called for read caches.
+//    Unread bytes, if any, move to the front of the cache first. Returns
+//    the number of bytes read, 0 at end of file, or -1 on error. Only
+//    called for read caches. The cache is resized first, unless `adapt`
+//    is false because the caller already did.
 
-void io61_fill(io61_file* f) {
+ssize_t io61_fill(io61_file* f, bool adapt = true) {
 
     // Check invariants.
     assert(f->tag <= f->pos_tag && f->pos_tag <= f->end_tag);
     assert(f->end_tag - f->pos_tag <= f->bufsize);
 
-    // Reset the cache to empty.
-    f->tag = f->pos_tag = f->end_tag;
+    // A mapped file slides its window forward to `pos_tag`.
+    if (f->map_size) {
+        off_t end_tag = f->end_tag;
+        f->seeked = false;
+        if (io61_map(f, f->pos_tag)) {
+            return f->end_tag - end_tag;
+        }
+    }
+    if (adapt) {
+        io61_adapt(f);
+    }
+
+    // A pipe-mode reader may receive input while it waits.
+    if (f->pipemode) {
+        return io61_pipe_fill(f, true);
+    }
+
+    // Keep the unread bytes, if any, at the front of the cache.
+    off_t keep = f->end_tag - f->pos_tag;
+    if (keep > 0 && f->pos_tag != f->tag) {
+        memmove(f->cbuf, &f->cbuf[f->pos_tag - f->tag], keep);
+    }
+    f->tag = f->pos_tag;
     // Read data.
-    ssize_t n = read(f->fd, f->cbuf, f->bufsize);
+    ssize_t n = read(f->fd, &f->cbuf[keep], f->bufsize - keep);
     if (n >= 0) {
-        f->end_tag = f->tag + n;
+        f->end_tag += n;
     }
 
     // Recheck invariants (good practice!).
     assert(f->tag <= f->pos_tag && f->pos_tag <= f->end_tag);
     assert(f->end_tag - f->pos_tag <= f->bufsize);
+    return n;
 }
 
 
@@ -61,7 +666,20 @@ void io61_fill(io61_file* f) {
 
 int io61_close(io61_file* f) {
     io61_flush(f);
+    if (f->map_size || f->pending) {
+        // leave the file offset where reading or writing stopped, as
+        // stdio does
+        lseek(f->fd, f->pos_tag, SEEK_SET);
+    }
+    if (f->map_size) {
+        munmap(f->cbuf, f->map_size);
+    }
+    if (f->pipemode) {
+        pipe_files.erase(std::find(pipe_files.begin(), pipe_files.end(), f));
+    }
     int r = close(f->fd);
+    delete[] f->buf;
+    delete f->pending;
     delete f;
     return r;
 }
@@ -93,7 +711,8 @@ int io61_readc(io61_file* f) {
 //    Read up to `sz` characters from `f` into `buf`. Returns the number of
 //    characters read on success; normally this is `sz`. Returns a short
 //    count, which might be zero, if the file ended before `sz` characters
-//    could be read. Returns -1 if an error occurred before any characters
+//    could be read, or if `f` is in pipe mode and no more characters are
+//    available yet. Returns -1 if an error occurred before any characters
 //    were read.
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
@@ -105,7 +724,11 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
     off_t ch = 0;
     while (pos < (off_t) sz) {
         if (f->pos_tag == f->end_tag) {
-            io61_fill(f);
+            if (f->pipemode && pos != 0) {
+                io61_pipe_fill(f, false);
+            } else {
+                io61_fill(f);
+            }
             if (f->pos_tag == f->end_tag) {
                 break;
             }
@@ -129,13 +752,178 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
+// io61_readline(f, buf, sz)
+//    Read a line from `f` into `buf`: the bytes up to and including the
+//    next newline, but no more than `sz` bytes. Returns the number of
+//    bytes read, 0 at end of file, or -1 if an error occurred before any
+//    bytes were read. The cache is searched with memchr, which glibc
+//    vectorizes, and each run of bytes up to the newline or the end of
+//    the cache is copied at once; a line may span several refills.
+
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz) {
+    size_t pos = 0;
+    while (pos != sz) {
+        if (f->pos_tag == f->end_tag) {
+            ssize_t n = io61_fill(f);
+            if (n <= 0) {
+                if (n < 0 && pos == 0) {
+                    return -1;
+                }
+                break;
+            }
+        }
+        const unsigned char* data = &f->cbuf[f->pos_tag - f->tag];
+        size_t m = std::min(sz - pos, (size_t) (f->end_tag - f->pos_tag));
+        const void* nl = memchr(data, '\n', m);
+        if (nl) {
+            m = (const unsigned char*) nl + 1 - data;
+        }
+        memcpy(&buf[pos], data, m);
+        f->pos_tag += m;
+        pos += m;
+        if (nl) {
+            break;
+        }
+    }
+    return pos;
+}
+
+
+// io61_readv(f, iov, iovcnt)
+//    Read from `f` into the `iovcnt` buffers described by `iov`, filling
+//    each in turn, as io61_read would fill one buffer. Returns the number
+//    of bytes read, short only at end of file or, in pipe mode, when no
+//    more bytes are available yet; or -1 if an error occurred before any
+//    bytes were read. Once the cache is empty, a request at least as
+//    large as the cache is read with one readv straight into the buffers,
+//    with the cache as one more buffer at the end.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t total = 0;
+    int i = 0;
+    size_t off = 0;     // bytes of `iov[i]` already filled
+    while (i != iovcnt) {
+        if (off == iov[i].iov_len) {
+            ++i;
+            off = 0;
+            continue;
+        }
+        if (f->pos_tag != f->end_tag) {
+            size_t ch = std::min(iov[i].iov_len - off,
+                                 (size_t) (f->end_tag - f->pos_tag));
+            memcpy((char*) iov[i].iov_base + off,
+                   &f->cbuf[f->pos_tag - f->tag], ch);
+            f->pos_tag += ch;
+            off += ch;
+            total += ch;
+            continue;
+        }
+
+        if (f->pipemode) {
+            // return what has arrived once nothing more is waiting
+            ssize_t n = io61_pipe_fill(f, total == 0);
+            if (n <= 0) {
+                if (n < 0 && total == 0) {
+                    return -1;
+                }
+                break;
+            }
+            continue;
+        }
+        iovec v[IOV_MAX];
+        int nv = 0;
+        size_t want = 0;
+        for (int j = i; j != iovcnt && nv != IOV_MAX - 1; ++j) {
+            v[nv].iov_base = (char*) iov[j].iov_base + (j == i ? off : 0);
+            v[nv].iov_len = iov[j].iov_len - (j == i ? off : 0);
+            want += v[nv].iov_len;
+            ++nv;
+        }
+        ssize_t n;
+        if (!f->map_size && want >= (size_t) f->bufsize) {
+            v[nv].iov_base = f->cbuf;
+            v[nv].iov_len = f->bufsize;
+            n = readv(f->fd, v, nv + 1);
+            if (n > 0) {
+                // bytes past the request stay in the cache
+                size_t user = std::min((size_t) n, want);
+                f->tag = f->pos_tag = f->end_tag + user;
+                f->end_tag = f->tag + (n - user);
+                total += user;
+                while (user != 0) {
+                    size_t ch = std::min(user, iov[i].iov_len - off);
+                    off += ch;
+                    user -= ch;
+                    if (off == iov[i].iov_len) {
+                        ++i;
+                        off = 0;
+                    }
+                }
+                continue;
+            }
+        } else {
+            n = io61_fill(f);
+        }
+        if (n <= 0) {
+            if (n < 0 && total == 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+    return total;
+}
+
+
+// io61_peek(f, ptr, min)
+//    Make at least `min` bytes of `f` readable without copying them, and
+//    set `*ptr` to point at them inside the cache. Returns the number of
+//    bytes available at `*ptr`, which may be more than `min`, or fewer if
+//    the file ends first; 0 at end of file; -1 if an error occurred
+//    before any bytes were available. `min` is capped at the cache size.
+//    The bytes stay valid until the next call on `f` other than
+//    io61_consume.
+
+ssize_t io61_peek(io61_file* f, const char** ptr, size_t min) {
+    if (min > (size_t) f->bufsize) {
+        min = f->bufsize;
+    } else if (min == 0) {
+        min = 1;
+    }
+    while (f->end_tag - f->pos_tag < (off_t) min) {
+        ssize_t n = io61_fill(f);
+        if (n <= 0) {
+            if (n < 0 && f->pos_tag == f->end_tag) {
+                return -1;
+            }
+            break;
+        }
+    }
+    *ptr = (const char*) &f->cbuf[f->pos_tag - f->tag];
+    f->peeking = f->pipemode;
+    return f->end_tag - f->pos_tag;
+}
+
+
+// io61_consume(f, n)
+//    Skip the next `n` bytes of `f`, which must have been returned by the
+//    last io61_peek.
+
+void io61_consume(io61_file* f, size_t n) {
+    assert((off_t) n <= f->end_tag - f->pos_tag);
+    f->pos_tag += n;
+    f->peeking = false;
+}
+
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
 
 int io61_writec(io61_file* f, int ch) {
     if (f->end_tag == f->tag + f->bufsize) {
-        io61_flush(f);
+        f->pending ? io61_stash(f) : io61_flush(f);
+        io61_adapt(f);
     }
     // This would be faster if you used `memcpy`!
     size_t count = 1;
@@ -163,7 +951,8 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
     size_t pos = 0;
     while (pos < sz) {
         if (f->end_tag == f->tag + f->bufsize) {
-            io61_flush(f);
+            f->pending ? io61_stash(f) : io61_flush(f);
+            io61_adapt(f);
         }
         if((off_t) (sz - pos) < f->bufsize - f->pos_tag + f->tag){
           ch = sz - pos;
@@ -182,6 +971,71 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers described by `iov` to `f`, in order, as
+//    io61_write would write them concatenated. Returns the number of
+//    bytes written, or -1 if an error occurred before any were written.
+//    Buffers too large for the cache go out with the cached bytes in a
+//    single writev.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    if (f->pending || f->pipemode || iovcnt >= IOV_MAX
+        || total <= (size_t) (f->tag + f->bufsize - f->end_tag)) {
+        size_t nwritten = 0;
+        for (int i = 0; i != iovcnt; ++i) {
+            ssize_t n = io61_write(f, (const char*) iov[i].iov_base,
+                                   iov[i].iov_len);
+            if (n < 0) {
+                return nwritten ? (ssize_t) nwritten : -1;
+            }
+            nwritten += n;
+        }
+        return nwritten;
+    }
+
+    iovec v[IOV_MAX];
+    int nv = 0;
+    size_t cached = f->end_tag - f->tag;
+    if (cached) {
+        v[nv].iov_base = f->cbuf;
+        v[nv].iov_len = cached;
+        ++nv;
+    }
+    std::copy(iov, iov + iovcnt, v + nv);
+    nv += iovcnt;
+    size_t done = 0;
+    for (iovec* p = v; done != cached + total; ) {
+        ssize_t n = writev(f->fd, p, nv - (p - v));
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+        // skip past what was written
+        while (p->iov_len <= (size_t) n) {
+            n -= p->iov_len;
+            ++p;
+            if (p == v + nv) {
+                break;
+            }
+        }
+        if (n) {
+            p->iov_base = (char*) p->iov_base + n;
+            p->iov_len -= n;
+        }
+    }
+    f->tag = f->pos_tag = f->end_tag = f->end_tag + total;
+    f->is_dirty = false;
+    if (done < cached + total) {
+        return done > cached ? (ssize_t) (done - cached) : -1;
+    }
+    return total;
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
@@ -192,6 +1046,25 @@ int io61_flush(io61_file* f) {
     assert(f->tag <= f->pos_tag && f->pos_tag <= f->end_tag);
     assert(f->end_tag - f->pos_tag <= f->bufsize);
 
+    // Read caches have nothing to write.
+    if (f->mode == O_RDONLY) {
+        return 0;
+    }
+
+    // A seeking writer's bytes may be spread over its slots and pending
+    // extents. Extents go first, since overlapping slot bytes are newer.
+    if (f->pending) {
+        int r = io61_stash(f);
+        r |= io61_pending_flush(f);
+        return io61_slot_flush(f) | r;
+    }
+
+    if (f->pos_tag == f->tag) {
+        return 0;
+    }
+    if (f->pipemode) {
+        return io61_pipe_write(f);
+    }
     size_t sz = write(f->fd, f->cbuf, f->pos_tag - f->tag);
     f->tag = f->pos_tag;
     f->is_dirty = false;
@@ -199,40 +1072,198 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_flush_files(fs, n)
+//    Flush each of the `n` files in `fs`. Returns 0 on success or -1 if
+//    any flush failed. Files with nothing buffered cost no system call.
+//    There is no system call that writes to several files, so each dirty
+//    file costs one write here; only the io_uring build submits all the
+//    writes before waiting for any.
+
+int io61_flush_files(io61_file* const* fs, size_t n) {
+    int r = 0;
+    for (size_t i = 0; i != n; ++i) {
+        if (io61_flush(fs[i]) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+
+// io61_copy(in, out, n)
+//    Copy up to `n` bytes from `in`, opened for reading, to `out`, opened
+//    for writing, stopping early at end of file. Returns the number of
+//    bytes copied, or -1 if an error occurred before any were copied.
+//    Bytes already in `in`'s cache are written from there; the rest move
+//    inside the kernel, with copy_file_range between regular files,
+//    sendfile from a file to a pipe or socket, and splice from a pipe.
+//    Pairs none of these support, and inputs whose first kernel copy
+//    returns nothing, are copied through the caches. `out` is
+//    flushed before the kernel takes over, and bytes sitting in its cache
+//    count as copied only once that succeeds, so a failed flush returns -1.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n) {
+    size_t copied = 0;
+    if (!in->map_size) {
+        while (copied != n && in->pos_tag != in->end_tag) {
+            size_t ch = std::min(n - copied, (size_t) (in->end_tag - in->pos_tag));
+            ssize_t w = io61_write(out, (const char*) &in->cbuf[in->pos_tag - in->tag], ch);
+            if (w < 0) {
+                return copied ? (ssize_t) copied : -1;
+            }
+            in->pos_tag += w;
+            copied += w;
+        }
+    }
+    if (copied == n) {
+        return copied;
+    } else if (io61_flush(out) < 0) {
+        return -1;
+    }
+
+    // A mapped input and a seeking writer use explicit file offsets;
+    // otherwise each file's offset is where its cache ends.
+    loff_t in_off = in->pos_tag;
+    loff_t out_off = out->pos_tag;
+    loff_t* outp = out->pending ? &out_off : nullptr;
+    // Pipe-mode files must not block inside the kernel.
+    enum { by_copy_file_range, by_sendfile, by_splice, by_cache } how
+        = in->pipemode || out->pipemode ? by_cache : by_copy_file_range;
+    bool worked = false;        // `how` has moved bytes
+    while (copied != n) {
+        size_t chunk = std::min(n - copied, (size_t) 1 << 30);
+        loff_t* inp = in->map_size ? &in_off : nullptr;
+        if (how == by_sendfile && outp) {
+            // sendfile writes at the output's file offset
+            how = by_splice;
+        }
+        ssize_t r;
+        if (how == by_copy_file_range) {
+            r = copy_file_range(in->fd, inp, out->fd, outp, chunk, 0);
+        } else if (how == by_sendfile) {
+            r = sendfile(out->fd, in->fd, (off_t*) inp, chunk);
+        } else if (how == by_splice) {
+            r = splice(in->fd, inp, out->fd, outp, chunk, SPLICE_F_MOVE);
+        } else {
+            break;
+        }
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r <= 0 && !worked) {
+            // 0 may only mean the method does not apply: files such as
+            // those in /proc report size 0 but have contents
+            how = (decltype(how)) (how + 1);
+            continue;
+        } else if (r < 0) {
+            return copied ? (ssize_t) copied : -1;
+        } else if (r == 0) {
+            return copied;
+        }
+        worked = true;
+        copied += r;
+        if (in->map_size) {
+            // slide the window along; if that fails, `in` reads again
+            // from its file offset, now `pos_tag`
+            in->pos_tag += r;
+            if (in->pos_tag > in->end_tag) {
+                io61_map(in, in->pos_tag);
+            }
+        } else {
+            in->tag = in->pos_tag = in->end_tag += r;
+        }
+        out->tag = out->pos_tag = out->end_tag += r;
+    }
+
+    // Copy the rest through the caches.
+    while (copied != n) {
+        const char* data;
+        ssize_t m = io61_peek(in, &data, 1);
+        if (m <= 0) {
+            if (m < 0 && copied == 0) {
+                return -1;
+            }
+            break;
+        }
+        m = std::min((size_t) m, n - copied);
+        ssize_t w = io61_write(out, data, m);
+        if (w < 0) {
+            return copied ? (ssize_t) copied : -1;
+        }
+        io61_consume(in, w);
+        copied += w;
+    }
+    return copied;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
-    int aligned_pos = pos;
     if(f->mode == O_WRONLY) {
-      if(f->is_dirty) {
-        io61_flush(f);
-      }
-      off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
-      if (r == pos) {
-        f->pos_tag = pos;
-        f->end_tag = f->pos_tag;
-        f->tag = f->pos_tag;
-        return 0;
+      if(f->pending) {
+        // written bytes wait in the slots and pending extents; writes
+        // are positioned, so the file offset need not move
+        if (pos < 0) {
+          return -1;
+        }
+        io61_stash(f);
       }
       else {
-        return -1;
+        // first seek: once the file proves seekable, switch to
+        // positioned writes through the slot cache
+        io61_flush(f);
+        if (lseek(f->fd, (off_t) pos, SEEK_SET) != pos) {
+          return -1;
+        }
+        f->pending = new io61_pending;
       }
+      f->seeked = true;
+      f->pos_tag = pos;
+      f->end_tag = f->pos_tag;
+      f->tag = f->pos_tag;
+      return 0;
     }
     else { 
+      if(!f->map_tried && pos >= 0) {
+        io61_map(f, pos);
+      }
+      bool backward = pos < f->last_seek;
+      f->last_seek = pos;
       if(pos >= f->tag && pos <= f->end_tag){
         f->pos_tag = pos;
         return 0;
       }
+      else if(f->map_size && pos >= 0 && io61_slide(f, pos)) {
+        // past the end of the file, reads return EOF
+        f->pos_tag = std::min(pos, f->end_tag);
+        return 0;
+      }
       else {
-        aligned_pos -= pos % BUFSIZE;
+        // Load an aligned window around `pos`. Scanning forward, `pos`
+        // starts the window; scanning backward, it ends the window, so
+        // the bytes read next are already cached. A scan that continues
+        // right past the cache in either direction counts as sequential,
+        // so the window grows.
+        if (pos < 0) {
+          return -1;
+        }
+        f->seeked = !(backward ? pos == f->tag - 1 : pos == f->end_tag);
+        f->tag = f->pos_tag = f->end_tag;
+        io61_adapt(f);
+        off_t aligned_pos = pos - pos % BUFSIZE;
+        if (backward) {
+          aligned_pos = std::max(aligned_pos + BUFSIZE - f->bufsize, (off_t) 0);
+        }
+        if (lseek(f->fd, aligned_pos, SEEK_SET) < 0) {
+          return -1;
+        }
         f->end_tag = aligned_pos;
         f->pos_tag = aligned_pos;
         f->tag = aligned_pos;
-        lseek(f->fd, (off_t) aligned_pos, SEEK_SET);
-        io61_fill(f);
-        f->pos_tag = pos;
+        io61_fill(f, false);
+        f->pos_tag = std::min(pos, f->end_tag);
         return 0;
       }
     }
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/uio.h>
 #include <vector>
 
 struct io61_file;
@@ -13,6 +14,7 @@ struct io61_file;
 io61_file* io61_fdopen(int fd, int mode);
 io61_file* io61_open_check(const char* filename, int mode);
 int io61_close(io61_file* f);
+int io61_pipemode(io61_file* f);
 
 off_t io61_filesize(io61_file* f);
 
@@ -24,7 +26,17 @@ int io61_writec(io61_file* f, int ch);
 ssize_t io61_read(io61_file* f, char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz);
 
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz);
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt);
+
+ssize_t io61_peek(io61_file* f, const char** ptr, size_t min);
+void io61_consume(io61_file* f, size_t n);
+
 int io61_flush(io61_file* f);
+int io61_flush_files(io61_file* const* fs, size_t n);
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n);
 
 void io61_profile_begin();
 void io61_profile_end();
@@ -35,6 +47,7 @@ struct io61_arguments {
     size_t block_size;          // `-b` option: block size. Default 0
     size_t stride;              // `-t` option: stride. Default 1024
     bool lines;                 // `-l` option: read by lines. Default false
+    bool vectored;              // `-v` option: vectored I/O. Default false
     const char* output_file;    // `-o` option: output file. Default nullptr
     const char* input_file;     // input file. Default nullptr
     std::vector<const char*> input_files;   // all input files
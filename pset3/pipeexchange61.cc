@@ -53,12 +53,29 @@ static size_t max_message_size() {
     return sz;
 }
 
+// read_message(f, buf, sz)
+//    Read a whole `sz`-byte message from `f`. In pipe mode, io61_read
+//    returns once part of a message has arrived.
+static ssize_t read_message(io61_file* f, char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread != sz) {
+        ssize_t r = io61_read(f, buf + nread, sz - nread);
+        if (r <= 0) {
+            return nread ? (ssize_t) nread : r;
+        }
+        nread += r;
+    }
+    return nread;
+}
+
 void requester(io61_file* outf, io61_file* inf) {
     size_t nmessages = sizeof(messages) / sizeof(messages[0]);
     size_t maxsz = max_message_size();
 
     char* buf = new char[maxsz];
     memset(buf, 0, maxsz);
+    io61_pipemode(outf);
+    io61_pipemode(inf);
 
     size_t requestid = 0;
     size_t responseid = 0;
@@ -76,7 +93,7 @@ void requester(io61_file* outf, io61_file* inf) {
         int x = io61_flush(outf);
         assert(x >= 0);
         for (int i = 0; i < m->request_batch; ++i) {
-            ssize_t r = io61_read(inf, buf, m->response_size);
+            ssize_t r = read_message(inf, buf, m->response_size);
             assert((size_t) r == m->response_size);
             memcpy(&id, buf, sizeof(size_t));
             assert(id == responseid);
@@ -96,11 +113,13 @@ void responder(io61_file* outf, io61_file* inf) {
     size_t maxsz = max_message_size();
     char* buf = new char[maxsz];
     memset(buf, 0, maxsz);
+    io61_pipemode(outf);
+    io61_pipemode(inf);
 
     for (size_t mindex = 0; mindex < nmessages; ++mindex) {
         const struct message_set* m = &messages[mindex];
         for (int i = 0; i < m->request_batch; ++i) {
-            ssize_t r = io61_read(inf, buf, m->request_size);
+            ssize_t r = read_message(inf, buf, m->request_size);
             assert((size_t) r == m->request_size);
             r = io61_write(outf, buf, m->response_size);
             assert((size_t) r == m->response_size);
@@ -55,6 +55,7 @@ io61_arguments::io61_arguments(int argc, char** argv, const char* opts_) {
     block_size = 0;
     stride = 1024;
     lines = false;
+    vectored = false;
     output_file = input_file = nullptr;
     opts = opts_;
     program_name = argv[0];
@@ -84,6 +85,9 @@ io61_arguments::io61_arguments(int argc, char** argv, const char* opts_) {
         case 'l':
             lines = true;
             break;
+        case 'v':
+            vectored = true;
+            break;
         case 'r': {
             unsigned long seed = strtoul(optarg, &endptr, 0);
             if (endptr == optarg || *endptr) {
@@ -142,6 +146,9 @@ void io61_arguments::usage() {
     if (strchr(opts, 'l')) {
         fprintf(stderr, " [-l]");
     }
+    if (strchr(opts, 'v')) {
+        fprintf(stderr, " [-v]");
+    }
     if (strchr(opts, 'o')) {
         fprintf(stderr, " [-o OUTFILE]");
     }
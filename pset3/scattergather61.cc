@@ -1,39 +1,77 @@
 #include "io61.hh"
+#include <algorithm>
 #include <vector>
 
-// Usage: ./scattergather61 [-b BLOCKSIZE] [-i IFILE | -o OFILE]...
+// Usage: ./scattergather61 [-b BLOCKSIZE] [-l | -v] [-i IFILE | -o OFILE]...
 //    Copies the input IFILEs to the output OFILEs, alternating
 //    with every block. (I.e., read from IFILE1 and write to OFILE1,
 //    then read from IFILE2 and write to OFILE2, etc. There may be
 //    different numbers of IFILEs and OFILEs.) This is a
 //    "scatter/gather" I/O pattern: input is "gathered" from many
 //    input files and "scattered" to many output files.
-//    Default BLOCKSIZE is 1.
+//    Default BLOCKSIZE is 1. With `-l`, a block ends early at a newline.
+//    With `-v`, the copy goes in rounds of vectored I/O instead: each
+//    round reads one block per OFILE from every IFILE with io61_readv,
+//    then writes OFILE j's blocks, block j of every IFILE, with
+//    io61_writev. The OFILEs are flushed together with io61_flush_files.
 
 ssize_t read_line(io61_file* f, char* buf, size_t sz, bool lines) {
     if (lines) {
-        size_t i = 0;
-        while (i != sz) {
-            int ch = io61_readc(f);
-            if (ch == EOF) {
-                break;
+        return io61_readline(f, buf, sz);
+    } else {
+        return io61_read(f, buf, sz);
+    }
+}
+
+
+// copy_vectored(infs, outfs, block_size)
+//    Copy in rounds of vectored I/O, as described above. Blocks cut
+//    short by the end of an IFILE are written short, and blocks past
+//    its end are written as empty buffers.
+
+void copy_vectored(std::vector<io61_file*>& infs,
+                   std::vector<io61_file*>& outfs, size_t block_size) {
+    size_t nout = outfs.size();
+    char* buf = new char[infs.size() * nout * block_size];
+    std::vector<iovec> iov(std::max(infs.size(), nout));
+    std::vector<size_t> got(infs.size());
+
+    while (!infs.empty()) {
+        size_t nin = infs.size();
+        for (size_t i = 0; i != nin; ++i) {
+            for (size_t j = 0; j != nout; ++j) {
+                iov[j].iov_base = buf + (i * nout + j) * block_size;
+                iov[j].iov_len = block_size;
             }
-            buf[i] = ch;
-            ++i;
-            if (ch == '\n') {
-                break;
+            ssize_t n = io61_readv(infs[i], iov.data(), nout);
+            got[i] = n > 0 ? n : 0;
+        }
+        for (size_t j = 0; j != nout; ++j) {
+            for (size_t i = 0; i != nin; ++i) {
+                size_t before = j * block_size;
+                iov[i].iov_base = buf + (i * nout + j) * block_size;
+                iov[i].iov_len = got[i] > before
+                    ? std::min(got[i] - before, block_size) : 0;
+            }
+            io61_writev(outfs[j], iov.data(), nin);
+        }
+        for (size_t i = nin; i-- != 0; ) {
+            if (got[i] != nout * block_size) {
+                io61_close(infs[i]);
+                infs.erase(infs.begin() + i);
+                got.erase(got.begin() + i);
             }
         }
-        return i;
-    } else {
-        return io61_read(f, buf, sz);
     }
+
+    io61_flush_files(outfs.data(), outfs.size());
+    delete[] buf;
 }
 
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_arguments args(argc, argv, "b:i:o:l##");
+    io61_arguments args(argc, argv, "b:i:o:lv##");
     size_t block_size = args.block_size ? args.block_size : 1;
 
     // Allocate buffer, open files
@@ -51,6 +89,9 @@ int main(int argc, char* argv[]) {
     }
 
     // Copy file data
+    if (args.vectored) {
+        copy_vectored(infs, outfs, block_size);
+    }
     size_t ini = -1, outi = 0;
     while (!infs.empty()) {
         ini = (ini + 1) % infs.size();
@@ -3,6 +3,8 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
+#include <string>
+#include <algorithm>
 
 // slow-io61.c
 //    This is a copy of the handout version of io61.c.
@@ -13,6 +15,8 @@
 
 struct io61_file {
     int fd;
+    std::string peeked;         // bytes read ahead by io61_peek
+    size_t peekpos = 0;         // next unread byte of `peeked`
 };
 
 
@@ -41,11 +45,24 @@ int io61_close(io61_file* f) {
 }
 
 
+// io61_pipemode(f)
+//    Nothing to do: there is no cache, so every write is already out
+//    before the next read. Returns 0.
+
+int io61_pipemode(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
 // io61_readc(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
 //    (which is -1) on error or end-of-file.
 
 int io61_readc(io61_file* f) {
+    if (f->peekpos != f->peeked.size()) {
+        return (unsigned char) f->peeked[f->peekpos++];
+    }
     unsigned char buf[1];
     if (read(f->fd, buf, 1) == 1) {
         return buf[0];
@@ -81,6 +98,101 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
+// io61_readline(f, buf, sz)
+//    Read a line from `f` into `buf`: the bytes up to and including the
+//    next newline, but no more than `sz` bytes. Returns the number of
+//    bytes read, 0 at end of file, or -1 if an error occurred before any
+//    bytes were read.
+
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz) {
+    size_t pos = 0;
+    while (pos != sz) {
+        const char* data;
+        ssize_t n = io61_peek(f, &data, 1);
+        if (n <= 0) {
+            if (n < 0 && pos == 0) {
+                return -1;
+            }
+            break;
+        }
+        size_t m = std::min((size_t) n, sz - pos);
+        const char* nl = (const char*) memchr(data, '\n', m);
+        if (nl) {
+            m = nl + 1 - data;
+        }
+        memcpy(&buf[pos], data, m);
+        io61_consume(f, m);
+        pos += m;
+        if (nl) {
+            break;
+        }
+    }
+    return pos;
+}
+
+
+// io61_readv(f, iov, iovcnt)
+//    Read from `f` into the `iovcnt` buffers described by `iov`, filling
+//    each in turn. Returns the number of bytes read, or -1 if an error
+//    occurred before any bytes were read.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t n = io61_read(f, (char*) iov[i].iov_base, iov[i].iov_len);
+        if (n < 0) {
+            return nread ? (ssize_t) nread : -1;
+        }
+        nread += n;
+        if ((size_t) n != iov[i].iov_len) {
+            break;
+        }
+    }
+    return nread;
+}
+
+
+// io61_peek(f, ptr, min)
+//    Make at least `min` bytes of `f` readable in place, and set `*ptr`
+//    to point at them. Returns the number of bytes available at
+//    `*ptr`, fewer than `min` only at end of file, or -1 on error. The
+//    bytes stay valid until the next call on `f` other than io61_consume.
+//    Peeked bytes are held in `f->peeked` and returned by later reads.
+
+ssize_t io61_peek(io61_file* f, const char** ptr, size_t min) {
+    if (min == 0) {
+        min = 1;
+    }
+    f->peeked.erase(0, f->peekpos);
+    f->peekpos = 0;
+    size_t have = f->peeked.size();
+    if (have < min) {
+        f->peeked.resize(min);
+        ssize_t r = 1;
+        while (have != min
+               && (r = read(f->fd, &f->peeked[have], min - have)) > 0) {
+            have += r;
+        }
+        f->peeked.resize(have);
+        if (have == 0 && r < 0) {
+            return -1;
+        }
+    }
+    *ptr = f->peeked.data();
+    return f->peeked.size();
+}
+
+
+// io61_consume(f, n)
+//    Skip the next `n` bytes of `f`, which must have been returned by the
+//    last io61_peek.
+
+void io61_consume(io61_file* f, size_t n) {
+    assert(n <= f->peeked.size() - f->peekpos);
+    f->peekpos += n;
+}
+
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
@@ -117,6 +229,28 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers described by `iov` to `f`, in order.
+//    Returns the number of bytes written, or -1 if an error occurred
+//    before any were written.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t n = io61_write(f, (const char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (n < 0) {
+            return nwritten ? (ssize_t) nwritten : -1;
+        }
+        nwritten += n;
+        if ((size_t) n != iov[i].iov_len) {
+            break;
+        }
+    }
+    return nwritten;
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
@@ -128,11 +262,57 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_flush_files(fs, n)
+//    Flush each of the `n` files in `fs`. Returns 0 on success or -1 if
+//    any flush failed.
+
+int io61_flush_files(io61_file* const* fs, size_t n) {
+    int r = 0;
+    for (size_t i = 0; i != n; ++i) {
+        if (io61_flush(fs[i]) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+
+// io61_copy(in, out, n)
+//    Copy up to `n` bytes from `in` to `out`, stopping early at end of
+//    file. Returns the number of bytes copied, or -1 if an error occurred
+//    before any were copied.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n) {
+    char buf[BUFSIZ];
+    size_t copied = 0;
+    while (copied != n) {
+        ssize_t r = io61_read(in, buf, std::min(n - copied, sizeof(buf)));
+        if (r <= 0) {
+            if (r < 0 && copied == 0) {
+                return -1;
+            }
+            break;
+        }
+        ssize_t w = io61_write(out, buf, r);
+        if (w < 0) {
+            return copied ? (ssize_t) copied : -1;
+        }
+        copied += w;
+        if (w != r) {
+            break;
+        }
+    }
+    return copied;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
+    f->peeked.clear();
+    f->peekpos = 0;
     off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
     if (r == (off_t) pos) {
         return 0;
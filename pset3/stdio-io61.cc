@@ -3,6 +3,8 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
+#include <string>
+#include <algorithm>
 
 // stdio-io61.c
 //    This version of io61.c is a simple wrapper on stdio. Can you beat it?
@@ -13,6 +15,8 @@
 
 struct io61_file {
     FILE* f;
+    std::string peeked;         // bytes read ahead by io61_peek
+    size_t peekpos = 0;         // next unread byte of `peeked`
 };
 
 
@@ -40,11 +44,24 @@ int io61_close(io61_file* f) {
 }
 
 
+// io61_pipemode(f)
+//    stdio has no pipe mode: reads still wait for all the bytes asked
+//    for, and buffered writes go out only when flushed. Returns 0.
+
+int io61_pipemode(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
 // io61_readc(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
 //    (which is -1) on error or end-of-file.
 
 int io61_readc(io61_file* f) {
+    if (f->peekpos != f->peeked.size()) {
+        return (unsigned char) f->peeked[f->peekpos++];
+    }
     return fgetc(f->f);
 }
 
@@ -57,7 +74,10 @@ int io61_readc(io61_file* f) {
 //    were read.
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
-    size_t n = fread(buf, 1, sz, f->f);
+    size_t p = std::min(sz, f->peeked.size() - f->peekpos);
+    memcpy(buf, f->peeked.data() + f->peekpos, p);
+    f->peekpos += p;
+    size_t n = p + fread(buf + p, 1, sz - p, f->f);
     if (n != 0 || sz == 0 || !ferror(f->f)) {
         return (ssize_t) n;
     } else {
@@ -66,6 +86,93 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
+// io61_readline(f, buf, sz)
+//    Read a line from `f` into `buf`: the bytes up to and including the
+//    next newline, but no more than `sz` bytes. Returns the number of
+//    bytes read, 0 at end of file, or -1 if an error occurred before any
+//    bytes were read.
+
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz) {
+    // bytes read ahead by io61_peek come first
+    const char* data = f->peeked.data() + f->peekpos;
+    size_t pos = std::min(sz, f->peeked.size() - f->peekpos);
+    const char* nl = (const char*) memchr(data, '\n', pos);
+    if (nl) {
+        pos = nl + 1 - data;
+    }
+    memcpy(buf, data, pos);
+    f->peekpos += pos;
+    int ch = nl ? '\n' : 0;
+    while (pos != sz && ch != '\n' && (ch = getc(f->f)) != EOF) {
+        buf[pos] = ch;
+        ++pos;
+    }
+    if (pos == 0 && ch == EOF && ferror(f->f)) {
+        return -1;
+    }
+    return pos;
+}
+
+
+// io61_readv(f, iov, iovcnt)
+//    Read from `f` into the `iovcnt` buffers described by `iov`, filling
+//    each in turn. Returns the number of bytes read, or -1 if an error
+//    occurred before any bytes were read.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t n = io61_read(f, (char*) iov[i].iov_base, iov[i].iov_len);
+        if (n < 0) {
+            return nread ? (ssize_t) nread : -1;
+        }
+        nread += n;
+        if ((size_t) n != iov[i].iov_len) {
+            break;
+        }
+    }
+    return nread;
+}
+
+
+// io61_peek(f, ptr, min)
+//    Make at least `min` bytes of `f` readable in place, and set `*ptr`
+//    to point at them. Returns the number of bytes available at
+//    `*ptr`, fewer than `min` only at end of file, or -1 on error. The
+//    bytes stay valid until the next call on `f` other than io61_consume.
+//    Peeked bytes are held in `f->peeked` and returned by later reads;
+//    stdio's own buffer is not exposed.
+
+ssize_t io61_peek(io61_file* f, const char** ptr, size_t min) {
+    if (min == 0) {
+        min = 1;
+    }
+    f->peeked.erase(0, f->peekpos);
+    f->peekpos = 0;
+    size_t have = f->peeked.size();
+    if (have < min) {
+        f->peeked.resize(min);
+        size_t r = fread(&f->peeked[have], 1, min - have, f->f);
+        f->peeked.resize(have + r);
+        if (f->peeked.empty() && ferror(f->f)) {
+            return -1;
+        }
+    }
+    *ptr = f->peeked.data();
+    return f->peeked.size();
+}
+
+
+// io61_consume(f, n)
+//    Skip the next `n` bytes of `f`, which must have been returned by the
+//    last io61_peek.
+
+void io61_consume(io61_file* f, size_t n) {
+    assert(n <= f->peeked.size() - f->peekpos);
+    f->peekpos += n;
+}
+
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
@@ -90,6 +197,28 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers described by `iov` to `f`, in order.
+//    Returns the number of bytes written, or -1 if an error occurred
+//    before any were written.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t n = io61_write(f, (const char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (n < 0) {
+            return nwritten ? (ssize_t) nwritten : -1;
+        }
+        nwritten += n;
+        if ((size_t) n != iov[i].iov_len) {
+            break;
+        }
+    }
+    return nwritten;
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
@@ -100,11 +229,58 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_flush_files(fs, n)
+//    Flush each of the `n` files in `fs`. Returns 0 on success or -1 if
+//    any flush failed.
+
+int io61_flush_files(io61_file* const* fs, size_t n) {
+    int r = 0;
+    for (size_t i = 0; i != n; ++i) {
+        if (io61_flush(fs[i]) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+
+// io61_copy(in, out, n)
+//    Copy up to `n` bytes from `in` to `out`, stopping early at end of
+//    file. Returns the number of bytes copied, or -1 if an error occurred
+//    before any were copied. stdio cannot tell how many buffered bytes
+//    reached the file before a write error, so any write error returns -1.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n) {
+    char buf[BUFSIZ];
+    size_t copied = 0;
+    while (copied != n) {
+        ssize_t r = io61_read(in, buf, std::min(n - copied, sizeof(buf)));
+        if (r <= 0) {
+            if (r < 0 && copied == 0) {
+                return -1;
+            }
+            break;
+        }
+        ssize_t w = io61_write(out, buf, r);
+        if (w < 0) {
+            return copied ? (ssize_t) copied : -1;
+        }
+        copied += w;
+        if (w != r) {
+            break;
+        }
+    }
+    return ferror(out->f) ? -1 : (ssize_t) copied;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
+    f->peeked.clear();
+    f->peekpos = 0;
     return fseek(f->f, pos, SEEK_SET);
 }
 
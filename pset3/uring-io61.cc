@@ -0,0 +1,951 @@
+#include "io61.hh"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <algorithm>
+
+// uring-io61.c
+//    This version of io61.c submits its reads and writes through io_uring,
+//    so I/O overlaps with the program's own work. A reader keeps up to
+//    NSLOT - 1 reads of a regular file, or one read of a pipe, in flight
+//    ahead of the consumer; a writer hands a full slot to the kernel and
+//    goes on filling the next.
+//    In pipe mode, a file waiting on its ring keeps reads of the other
+//    pipe-mode readers going, so their input is absorbed into free slots.
+//    If io_uring is unavailable, the same slots are read and written
+//    synchronously, and pipe mode has no effect. Link a test against
+//    uring-io61.o (`make uring`) to use it.
+
+constexpr int NSLOT = 4;                // I/O slots per file
+constexpr ssize_t SLOTSIZE = 64 << 10;  // bytes of I/O per slot
+constexpr ssize_t SEEKSIZE = 4096;      // bytes read after a seek
+
+
+// uring_slot
+//    One buffer of an io61_file and the I/O request using it. A slot's
+//    memory holds SLOTSIZE bytes of headroom before its data, where
+//    io61_peek moves bytes left over from the previous slot.
+
+struct uring_slot {
+    unsigned char* mem = new unsigned char[2 * SLOTSIZE];
+    unsigned char* data = mem + SLOTSIZE;
+    off_t off = 0;          // file offset of `data`
+    size_t len = 0;         // bytes requested
+    size_t base = 0;        // bytes already transferred when submitted
+    ssize_t res = 0;        // bytes transferred, or -errno
+    int op = 0;             // IORING_OP_READ or IORING_OP_WRITE
+    bool busy = false;      // request submitted, not yet complete
+    bool cancel = false;    // request being cancelled; do not retry it
+};
+
+
+// uring
+//    The submission and completion rings of an io_uring instance.
+
+struct uring {
+    int fd = -1;            // -1 if io_uring is unavailable
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    void* sq_ptr = MAP_FAILED;
+    size_t sq_len = 0;
+    void* cq_ptr = MAP_FAILED;
+    size_t cq_len = 0;
+    void* sqes_ptr = MAP_FAILED;
+    size_t sqes_len = 0;
+};
+
+
+// io61_file
+//    Data structure for io61 file wrappers.
+
+struct io61_file {
+    int fd;
+    int mode;
+    bool seekable;          // positioned I/O works (regular files, devices)
+    bool eof = false;       // a read returned end of file
+    bool seeked = false;    // a read seek missed; do not read ahead yet
+    bool pipemode = false;  // set by io61_pipemode
+    uring ring;
+    uring_slot slot[NSLOT];
+    int cur = 0;            // slot being consumed or filled
+    int queued = 0;         // reads in flight after `cur`
+    int depth = 1;          // reads to keep in flight after `cur`
+    off_t next_off = 0;     // file offset of the next read or write
+    unsigned char* pos;     // next byte to read or write in `slot[cur]`
+    unsigned char* end;     // end of data to read, or of space to write
+};
+
+
+// pipe_files: the open files in pipe mode; see io61_pipemode.
+static std::vector<io61_file*> pipe_files;
+
+
+static void uring_open(uring& r);
+static void uring_close(uring& r);
+static bool uring_start(io61_file* f, int i, int op, off_t off, size_t len);
+static void uring_submit(io61_file* f, int i, int op, off_t off, size_t len);
+static bool uring_read_ahead(io61_file* f, int nslot);
+static void uring_reap(io61_file* f);
+static ssize_t uring_wait(io61_file* f, int i);
+static void uring_cancel(io61_file* f, int i);
+static void uring_drain(io61_file* f);
+
+
+// io61_fdopen(fd, mode)
+//    Return a new io61_file for file descriptor `fd`. `mode` is
+//    either O_RDONLY for a read-only file or O_WRONLY for a
+//    write-only file. You need not support read/write files.
+
+io61_file* io61_fdopen(int fd, int mode) {
+    assert(fd >= 0);
+    io61_file* f = new io61_file;
+    f->fd = fd;
+    f->mode = mode;
+    f->next_off = lseek(fd, 0, SEEK_CUR);
+    f->seekable = f->next_off >= 0;
+    if (!f->seekable) {
+        // reads of a pipe must reach it in order, so only one goes ahead
+        f->next_off = 0;
+        f->depth = 0;
+    }
+    uring_open(f->ring);
+    f->pos = f->slot[0].data;
+    f->end = mode == O_RDONLY ? f->pos : f->pos + SLOTSIZE;
+    return f;
+}
+
+
+// io61_close(f)
+//    Close the io61_file `f` and release all its resources.
+
+int io61_close(io61_file* f) {
+    io61_flush(f);
+    uring_drain(f);
+    if (f->pipemode) {
+        pipe_files.erase(std::find(pipe_files.begin(), pipe_files.end(), f));
+    }
+    if (f->seekable) {
+        // leave the file offset where reading or writing stopped
+        off_t off = f->next_off;
+        if (f->mode == O_RDONLY) {
+            off = f->slot[f->cur].off + (f->pos - f->slot[f->cur].data);
+        }
+        lseek(f->fd, off, SEEK_SET);
+    }
+    uring_close(f->ring);
+    int r = close(f->fd);
+    for (auto& s : f->slot) {
+        delete[] s.mem;
+    }
+    delete f;
+    return r;
+}
+
+
+// io61_fill(f, len)
+//    Make the next read slot of `f` current, starting a read of `len`
+//    bytes for it if none is in flight, and top up the reads in flight
+//    behind it. Bytes not yet consumed from the old slot move to the new
+//    slot's headroom. In pipe mode, the pipe-mode writers are flushed
+//    before waiting for the read. Returns the number of bytes read, 0 at
+//    end of file, or -1 on error.
+
+static ssize_t io61_fill(io61_file* f, size_t len = SLOTSIZE) {
+    if (f->eof) {
+        return 0;
+    }
+    int next = (f->cur + 1) % NSLOT;
+    if (f->queued == 0) {
+        uring_submit(f, next, IORING_OP_READ, f->next_off, len);
+        f->next_off += len;
+        ++f->queued;
+    } else if (f->slot[next].busy && f->slot[next].base != 0) {
+        // the slot already holds input: take it rather than wait for more
+        uring_cancel(f, next);
+    }
+    uring_reap(f);
+    if (f->pipemode && f->slot[next].busy && !f->slot[next].cancel) {
+        for (io61_file* g : pipe_files) {
+            if (g->mode != O_RDONLY) {
+                io61_flush(g);
+            }
+        }
+    }
+    ssize_t n = uring_wait(f, next);
+    --f->queued;
+    if (n < 0) {
+        // try again at the same offset next time
+        uring_drain(f);
+        f->next_off = f->slot[next].off;
+        return -1;
+    }
+
+    uring_slot& s = f->slot[next];
+    size_t left = f->end - f->pos;
+    memcpy(s.data - left, f->pos, left);
+    f->cur = next;
+    f->pos = s.data - left;
+    f->end = s.data + n;
+
+    if (n == 0) {
+        f->eof = true;
+        uring_drain(f);
+    } else if (f->seekable && n < (ssize_t) s.len) {
+        // short read: reads in flight started past the bytes returned
+        uring_drain(f);
+        f->next_off = s.off + n;
+    } else if (!f->seekable) {
+        uring_read_ahead(f, 1);
+    } else if (f->seeked) {
+        f->seeked = false;
+    } else if (f->seekable) {
+        // sequential progress: read further ahead
+        f->depth = std::min(f->depth + 1, NSLOT - 1);
+        while (f->queued < f->depth) {
+            int i = (f->cur + 1 + f->queued) % NSLOT;
+            uring_submit(f, i, IORING_OP_READ, f->next_off, SLOTSIZE);
+            f->next_off += SLOTSIZE;
+            ++f->queued;
+        }
+    }
+    return n;
+}
+
+
+// io61_pipemode(f)
+//    Put `f`, normally a pipe or socket carrying a request/response
+//    protocol, in pipe mode. Reads from a pipe-mode file return as soon
+//    as some bytes have arrived, rather than waiting for all `sz`. Before
+//    such a read would block, every pipe-mode writer is flushed; and
+//    while a pipe-mode file waits on its ring, input arriving on the
+//    pipe-mode readers is read into their free slots, up to NSLOT - 1
+//    slots each, so two processes that both write before reading cannot
+//    deadlock on full pipes. Seekable files are left alone. Returns 0.
+
+int io61_pipemode(io61_file* f) {
+    if (!f->pipemode && !f->seekable) {
+        f->pipemode = true;
+        pipe_files.push_back(f);
+    }
+    return 0;
+}
+
+
+// io61_readc(f)
+//    Read a single (unsigned) character from `f` and return it. Returns EOF
+//    (which is -1) on error or end-of-file.
+
+int io61_readc(io61_file* f) {
+    if (f->pos == f->end && io61_fill(f) <= 0) {
+        return EOF;
+    }
+    return *f->pos++;
+}
+
+
+// io61_read(f, buf, sz)
+//    Read up to `sz` characters from `f` into `buf`. Returns the number of
+//    characters read on success; normally this is `sz`. Returns a short
+//    count, which might be zero, if the file ended before `sz` characters
+//    could be read, or if `f` is in pipe mode and no more characters are
+//    available yet. Returns -1 if an error occurred before any characters
+//    were read.
+
+ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread != sz) {
+        if (f->pos == f->end) {
+            if (f->pipemode && nread != 0) {
+                // stop unless the next slot has input
+                uring_reap(f);
+                uring_slot& s = f->slot[(f->cur + 1) % NSLOT];
+                if (f->queued == 0 || (s.busy && s.base == 0)) {
+                    break;
+                }
+            }
+            ssize_t n = io61_fill(f);
+            if (n <= 0) {
+                if (n < 0 && nread == 0) {
+                    return -1;
+                }
+                break;
+            }
+        }
+        size_t ch = std::min(sz - nread, (size_t) (f->end - f->pos));
+        memcpy(&buf[nread], f->pos, ch);
+        f->pos += ch;
+        nread += ch;
+    }
+    return nread;
+}
+
+
+// io61_readline(f, buf, sz)
+//    Read a line from `f` into `buf`: the bytes up to and including the
+//    next newline, but no more than `sz` bytes. Returns the number of
+//    bytes read, 0 at end of file, or -1 if an error occurred before any
+//    bytes were read.
+
+ssize_t io61_readline(io61_file* f, char* buf, size_t sz) {
+    size_t pos = 0;
+    while (pos != sz) {
+        const char* data;
+        ssize_t n = io61_peek(f, &data, 1);
+        if (n <= 0) {
+            if (n < 0 && pos == 0) {
+                return -1;
+            }
+            break;
+        }
+        size_t m = std::min((size_t) n, sz - pos);
+        const char* nl = (const char*) memchr(data, '\n', m);
+        if (nl) {
+            m = nl + 1 - data;
+        }
+        memcpy(&buf[pos], data, m);
+        io61_consume(f, m);
+        pos += m;
+        if (nl) {
+            break;
+        }
+    }
+    return pos;
+}
+
+
+// io61_readv(f, iov, iovcnt)
+//    Read from `f` into the `iovcnt` buffers described by `iov`, filling
+//    each in turn. Returns the number of bytes read, or -1 if an error
+//    occurred before any bytes were read.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t n = io61_read(f, (char*) iov[i].iov_base, iov[i].iov_len);
+        if (n < 0) {
+            return nread ? (ssize_t) nread : -1;
+        }
+        nread += n;
+        if ((size_t) n != iov[i].iov_len) {
+            break;
+        }
+    }
+    return nread;
+}
+
+
+// io61_peek(f, ptr, min)
+//    Make at least `min` bytes of `f` readable without copying them, and
+//    set `*ptr` to point at them inside the current slot. Returns the
+//    number of bytes available at `*ptr`, fewer than `min` only at end of
+//    file, or -1 if an error occurred before any bytes were available.
+//    `min` is capped at SLOTSIZE. The bytes stay valid until the next
+//    call on `f` other than io61_consume.
+
+ssize_t io61_peek(io61_file* f, const char** ptr, size_t min) {
+    min = std::max(std::min(min, (size_t) SLOTSIZE), (size_t) 1);
+    while ((size_t) (f->end - f->pos) < min) {
+        ssize_t n = io61_fill(f);
+        if (n <= 0) {
+            if (n < 0 && f->pos == f->end) {
+                return -1;
+            }
+            break;
+        }
+    }
+    *ptr = (const char*) f->pos;
+    return f->end - f->pos;
+}
+
+
+// io61_consume(f, n)
+//    Skip the next `n` bytes of `f`, which must have been returned by the
+//    last io61_peek.
+
+void io61_consume(io61_file* f, size_t n) {
+    assert(n <= (size_t) (f->end - f->pos));
+    f->pos += n;
+}
+
+
+// io61_spill(f)
+//    Start writing the current slot of `f` and make the next slot
+//    current, waiting until the kernel is done with it. Returns 0 on
+//    success or -1 if a write failed.
+
+static int io61_spill(io61_file* f) {
+    uring_slot& s = f->slot[f->cur];
+    size_t n = f->pos - s.data;
+    if (n == 0) {
+        return 0;
+    }
+    if (!f->seekable) {
+        // writes to a pipe must reach it in order
+        uring_drain(f);
+    }
+    uring_submit(f, f->cur, IORING_OP_WRITE, f->next_off, n);
+    f->next_off += n;
+    f->cur = (f->cur + 1) % NSLOT;
+    ssize_t r = uring_wait(f, f->cur);
+    f->pos = f->slot[f->cur].data;
+    f->end = f->pos + SLOTSIZE;
+    return r < 0 ? -1 : 0;
+}
+
+
+// io61_writec(f)
+//    Write a single character `ch` to `f`. Returns 0 on success or
+//    -1 on error.
+
+int io61_writec(io61_file* f, int ch) {
+    if (f->pos == f->end && io61_spill(f) < 0) {
+        return -1;
+    }
+    *f->pos++ = ch;
+    return 0;
+}
+
+
+// io61_write(f, buf, sz)
+//    Write `sz` characters from `buf` to `f`. Returns the number of
+//    characters written on success; normally this is `sz`. Returns -1 if
+//    an error occurred before any characters were written.
+
+ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        if (f->pos == f->end && io61_spill(f) < 0) {
+            return nwritten ? (ssize_t) nwritten : -1;
+        }
+        size_t ch = std::min(sz - nwritten, (size_t) (f->end - f->pos));
+        memcpy(f->pos, &buf[nwritten], ch);
+        f->pos += ch;
+        nwritten += ch;
+    }
+    return nwritten;
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers described by `iov` to `f`, in order.
+//    Returns the number of bytes written, or -1 if an error occurred
+//    before any were written.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t n = io61_write(f, (const char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (n < 0) {
+            return nwritten ? (ssize_t) nwritten : -1;
+        }
+        nwritten += n;
+        if ((size_t) n != iov[i].iov_len) {
+            break;
+        }
+    }
+    return nwritten;
+}
+
+
+// io61_flush(f)
+//    Forces a write of all buffered data written to `f`.
+//    If `f` was opened read-only, io61_flush(f) may either drop all
+//    data buffered for reading, or do nothing.
+
+int io61_flush(io61_file* f) {
+    if (f->mode == O_RDONLY) {
+        return 0;
+    }
+    int r = io61_spill(f);
+    for (int i = 0; i != NSLOT; ++i) {
+        if (uring_wait(f, i) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+
+// io61_flush_files(fs, n)
+//    Flush each of the `n` files in `fs`. Returns 0 on success or -1 if
+//    any flush failed. Every file's final write is submitted before any
+//    is waited for, so the writes proceed together.
+
+int io61_flush_files(io61_file* const* fs, size_t n) {
+    int r = 0;
+    for (size_t i = 0; i != n; ++i) {
+        if (fs[i]->mode != O_RDONLY && io61_spill(fs[i]) < 0) {
+            r = -1;
+        }
+    }
+    for (size_t i = 0; i != n; ++i) {
+        if (io61_flush(fs[i]) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+
+// io61_copy(in, out, n)
+//    Copy up to `n` bytes from `in` to `out`, stopping early at end of
+//    file. Returns the number of bytes copied, or -1 if an error occurred
+//    before any were copied. Bytes go straight from `in`'s read slots to
+//    `out`'s write slots. A failed write may have lost bytes of earlier
+//    slots, so any write error returns -1.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n) {
+    size_t copied = 0;
+    while (copied != n) {
+        const char* data;
+        ssize_t m = io61_peek(in, &data, 1);
+        if (m <= 0) {
+            if (m < 0 && copied == 0) {
+                return -1;
+            }
+            break;
+        }
+        m = std::min((size_t) m, n - copied);
+        ssize_t w = io61_write(out, data, m);
+        if (w != m) {
+            return -1;
+        }
+        io61_consume(in, w);
+        copied += w;
+    }
+    return copied;
+}
+
+
+// io61_seek(f, pos)
+//    Change the file pointer for file `f` to `pos` bytes into the file.
+//    Returns 0 on success and -1 on failure.
+
+int io61_seek(io61_file* f, off_t pos) {
+    if (!f->seekable || pos < 0) {
+        return -1;
+    }
+    if (f->mode != O_RDONLY) {
+        int r = io61_flush(f);
+        f->next_off = pos;
+        return r;
+    }
+
+    uring_slot& s = f->slot[f->cur];
+    if (pos >= s.off && pos <= s.off + (f->end - s.data)) {
+        f->pos = s.data + (pos - s.off);
+        return 0;
+    }
+    // Read the aligned block around `pos`. A seek is taken as random
+    // access, so only a small block is read, and no further reads go
+    // ahead until reading proves sequential again.
+    uring_drain(f);
+    f->eof = false;
+    f->seeked = true;
+    f->depth = 0;
+    f->next_off = pos - pos % SEEKSIZE;
+    f->pos = f->end;
+    ssize_t n = io61_fill(f, SEEKSIZE);
+    if (n < 0) {
+        return -1;
+    }
+    uring_slot& t = f->slot[f->cur];
+    f->pos = t.data + std::min(pos - t.off, (off_t) (f->end - t.data));
+    return 0;
+}
+
+
+// uring_open(r)
+//    Set up io_uring instance `r`. Leaves `r.fd` at -1 if io_uring is
+//    unavailable.
+
+static void uring_open(uring& r) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, NSLOT, &p);
+    if (fd < 0) {
+        return;
+    }
+    r.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    r.sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    r.sq_ptr = mmap(nullptr, r.sq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r.cq_ptr = mmap(nullptr, r.cq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r.sqes_ptr = mmap(nullptr, r.sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    r.fd = fd;
+    if (r.sq_ptr == MAP_FAILED || r.cq_ptr == MAP_FAILED
+        || r.sqes_ptr == MAP_FAILED) {
+        uring_close(r);
+        return;
+    }
+    char* sq = (char*) r.sq_ptr;
+    char* cq = (char*) r.cq_ptr;
+    r.sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    r.sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    r.sq_array = (unsigned*) (sq + p.sq_off.array);
+    r.sqes = (io_uring_sqe*) r.sqes_ptr;
+    r.cq_head = (unsigned*) (cq + p.cq_off.head);
+    r.cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    r.cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    r.cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+}
+
+
+// uring_close(r)
+//    Tear down io_uring instance `r`. The kernel cancels any requests
+//    still in flight.
+
+static void uring_close(uring& r) {
+    if (r.sq_ptr != MAP_FAILED) {
+        munmap(r.sq_ptr, r.sq_len);
+    }
+    if (r.cq_ptr != MAP_FAILED) {
+        munmap(r.cq_ptr, r.cq_len);
+    }
+    if (r.sqes_ptr != MAP_FAILED) {
+        munmap(r.sqes_ptr, r.sqes_len);
+    }
+    if (r.fd >= 0) {
+        close(r.fd);
+    }
+    r.fd = -1;
+    r.sq_ptr = r.cq_ptr = r.sqes_ptr = MAP_FAILED;
+}
+
+
+// uring_sync(f, i)
+//    Perform the request of slot `i` of `f`, past the bytes already
+//    transferred, synchronously.
+
+static void uring_sync(io61_file* f, int i) {
+    uring_slot& s = f->slot[i];
+    unsigned char* data = s.data + s.base;
+    size_t len = s.len - s.base;
+    off_t off = s.off + s.base;
+    ssize_t n;
+    if (s.op == IORING_OP_READ) {
+        n = f->seekable ? pread(f->fd, data, len, off)
+            : read(f->fd, data, len);
+    } else {
+        n = f->seekable ? pwrite(f->fd, data, len, off)
+            : write(f->fd, data, len);
+    }
+    s.res = n < 0 ? -errno : s.base + n;
+}
+
+
+// uring_enter(r, sqe)
+//    Submit the entry `sqe`, filled in by the caller, to `r`. Returns
+//    true if the kernel took it; otherwise the entry is withdrawn.
+
+static bool uring_enter(uring& r, const io_uring_sqe& sqe) {
+    unsigned tail = *r.sq_tail;
+    unsigned idx = tail & *r.sq_mask;
+    r.sqes[idx] = sqe;
+    r.sq_array[idx] = idx;
+    __atomic_store_n(r.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int n;
+    do {
+        n = syscall(__NR_io_uring_enter, r.fd, 1, 0, 0, nullptr, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1) {
+        __atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+    }
+    return n == 1;
+}
+
+
+// uring_issue(f, i)
+//    Submit the request of slot `i` of `f`, past the `base` bytes already
+//    transferred, through the ring. Returns false, and starts nothing, if
+//    the ring is unavailable or refuses it.
+
+static bool uring_issue(io61_file* f, int i) {
+    uring_slot& s = f->slot[i];
+    assert(!s.busy);
+    s.cancel = false;
+    uring& r = f->ring;
+    if (r.fd < 0) {
+        return false;
+    }
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = s.op;
+    sqe.fd = f->fd;
+    sqe.addr = (unsigned long) (s.data + s.base);
+    sqe.len = s.len - s.base;
+    sqe.off = f->seekable ? s.off + s.base : (off_t) -1;
+    sqe.user_data = i;
+    s.busy = uring_enter(r, sqe);
+    return s.busy;
+}
+
+
+// uring_start(f, i, op, off, len)
+//    Start operation `op` (IORING_OP_READ or IORING_OP_WRITE) of `len`
+//    bytes on the data of slot `i` of `f` through the ring, at file offset
+//    `off` if `f` is seekable or at the file position otherwise. Returns
+//    false, and starts nothing, if the ring is unavailable or refuses it.
+
+static bool uring_start(io61_file* f, int i, int op, off_t off, size_t len) {
+    uring_slot& s = f->slot[i];
+    s.op = op;
+    s.off = off;
+    s.len = len;
+    s.base = 0;
+    return uring_issue(f, i);
+}
+
+
+// uring_submit(f, i, op, off, len)
+//    Like uring_start, but if the ring does not take the request, do the
+//    work here.
+
+static void uring_submit(io61_file* f, int i, int op, off_t off, size_t len) {
+    if (!uring_start(f, i, op, off, len)) {
+        uring_sync(f, i);
+    }
+}
+
+
+// uring_read_ahead(f, nslot)
+//    Keep one read of the pipe `f` in flight through the ring, filling at
+//    most `nslot` slots after `cur`. The read appends to the last slot
+//    read ahead while that has room, then starts the next slot. Reads of
+//    a pipe must reach it in order, so only one is ever in flight; none
+//    is done synchronously, since it would wait for data the program may
+//    never ask for. Returns true if a read is in flight.
+
+static bool uring_read_ahead(io61_file* f, int nslot) {
+    int last = (f->cur + f->queued) % NSLOT;
+    uring_slot& s = f->slot[last];
+    if (f->queued != 0 && s.busy) {
+        return true;
+    } else if (f->eof || (f->queued != 0 && s.res <= 0)) {
+        // end of file or an error: leave it for the consumer
+        return false;
+    } else if (f->queued != 0 && (size_t) s.res < s.len) {
+        s.base = s.res;
+        return uring_issue(f, last);
+    } else if (f->queued < nslot
+               && uring_start(f, (last + 1) % NSLOT, IORING_OP_READ,
+                              0, SLOTSIZE)) {
+        ++f->queued;
+        return true;
+    }
+    return false;
+}
+
+
+// uring_reap(f)
+//    Record the results of the requests of `f` that have completed. A
+//    request that continued a slot adds to the bytes it already had; an
+//    appended read that fails or is cancelled leaves the slot as it was,
+//    with no more room.
+
+static void uring_reap(io61_file* f) {
+    uring& r = f->ring;
+    if (r.fd < 0) {
+        return;
+    }
+    unsigned head = *r.cq_head;
+    unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        io_uring_cqe* cqe = &r.cqes[head & *r.cq_mask];
+        if (cqe->user_data >= NSLOT) {
+            continue;               // a cancel request
+        }
+        uring_slot& s = f->slot[cqe->user_data];
+        if (cqe->res > 0 || s.base == 0) {
+            s.res = s.base + cqe->res;
+        } else if (s.op == IORING_OP_READ) {
+            s.res = s.len = s.base;
+        } else {
+            s.res = cqe->res < 0 ? cqe->res : -EIO;
+        }
+        s.busy = false;
+    }
+    __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+// uring_pipe_wait(f, i)
+//    Wait for the request of slot `i` of the pipe-mode file `f` to
+//    complete, meanwhile reading input that arrives on the other
+//    pipe-mode readers into their slots. A reader whose slots are full is
+//    not read, so a peer that floods us waits until we read. Returns
+//    early, leaving the wait to the caller, if poll fails.
+
+static void uring_pipe_wait(io61_file* f, int i) {
+    std::vector<pollfd> pfds;
+    while (true) {
+        uring_reap(f);
+        if (!f->slot[i].busy) {
+            return;
+        }
+        pfds.assign(1, pollfd{f->ring.fd, POLLIN, 0});
+        for (io61_file* g : pipe_files) {
+            if (g != f && g->mode == O_RDONLY) {
+                uring_reap(g);
+                if (uring_read_ahead(g, NSLOT - 1)) {
+                    pfds.push_back(pollfd{g->ring.fd, POLLIN, 0});
+                }
+            }
+        }
+        if (poll(pfds.data(), pfds.size(), -1) < 0 && errno != EINTR) {
+            return;
+        }
+    }
+}
+
+
+// uring_wait(f, i)
+//    Wait for the request of slot `i` of `f` to complete, and return its
+//    result: a byte count, or -1 on error. Short writes are finished
+//    synchronously, or through the ring in pipe mode. Requests the kernel
+//    rejects as unsupported are retried synchronously. If waiting itself
+//    fails, every request in flight fails with that error and `f` stops
+//    using io_uring.
+
+static ssize_t uring_wait(io61_file* f, int i) {
+    uring_slot& s = f->slot[i];
+    uring& r = f->ring;
+    while (true) {
+        if (f->pipemode && s.busy) {
+            uring_pipe_wait(f, i);
+        }
+        while (s.busy) {
+            uring_reap(f);
+            if (s.busy
+                && syscall(__NR_io_uring_enter, r.fd, 0, 1,
+                           IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+                && errno != EINTR) {
+                // closing the ring cancels the requests
+                int err = errno;
+                for (int j = 0; j != NSLOT; ++j) {
+                    if (f->slot[j].busy) {
+                        f->slot[j].res = -err;
+                        f->slot[j].busy = false;
+                    }
+                }
+                uring_close(r);
+            }
+        }
+        if (!s.cancel && (s.res == -EINVAL || s.res == -EOPNOTSUPP
+                          || s.res == -EINTR || s.res == -EAGAIN)) {
+            uring_sync(f, i);
+        }
+        if (s.op != IORING_OP_WRITE || s.res < 0
+            || (size_t) s.res == s.len) {
+            break;
+        }
+        // finish a short write; a pipe-mode writer goes on absorbing
+        // input until the rest fits
+        s.base = s.res;
+        if (s.res == 0 || !f->pipemode || !uring_issue(f, i)) {
+            uring_sync(f, i);
+            if (s.res == (ssize_t) s.base) {
+                s.res = -EIO;
+            }
+        }
+    }
+    ssize_t res = s.res < 0 ? -1 : s.res;
+    if (s.op == IORING_OP_WRITE) {
+        // report each completed write once
+        s.len = 0;
+        s.res = 0;
+    }
+    return res;
+}
+
+
+// uring_cancel(f, i)
+//    Ask the kernel to cancel the read of slot `i` of `f`, which might
+//    never complete. The read still completes, with whatever it took;
+//    it is not retried.
+
+static void uring_cancel(io61_file* f, int i) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.addr = i;
+    sqe.user_data = NSLOT;
+    f->slot[i].cancel = true;
+    uring_enter(f->ring, sqe);
+}
+
+
+// uring_drain(f)
+//    Wait for every request of `f` to complete and forget any reads in
+//    flight. A read of a pipe might never complete, so it is cancelled
+//    first; bytes it already took are dropped with it.
+
+static void uring_drain(io61_file* f) {
+    for (int i = 0; i != NSLOT; ++i) {
+        uring_slot& s = f->slot[i];
+        if (s.busy && !f->seekable && s.op == IORING_OP_READ) {
+            uring_cancel(f, i);
+        }
+    }
+    for (int i = 0; i != NSLOT; ++i) {
+        if (f->slot[i].busy) {
+            uring_wait(f, i);
+        }
+    }
+    f->queued = 0;
+}
+
+
+// You shouldn't need to change these functions.
+
+// io61_open_check(filename, mode)
+//    Open the file corresponding to `filename` and return its io61_file.
+//    If `!filename`, returns either the standard input or the
+//    standard output, depending on `mode`. Exits with an error message if
+//    `filename != nullptr` and the named file cannot be opened.
+
+io61_file* io61_open_check(const char* filename, int mode) {
+    int fd;
+    if (filename) {
+        fd = open(filename, mode, 0666);
+    } else if ((mode & O_ACCMODE) == O_RDONLY) {
+        fd = STDIN_FILENO;
+    } else {
+        fd = STDOUT_FILENO;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    return io61_fdopen(fd, mode & O_ACCMODE);
+}
+
+
+// io61_filesize(f)
+//    Return the size of `f` in bytes. Returns -1 if `f` does not have a
+//    well-defined size (for instance, if it is a pipe).
+
+off_t io61_filesize(io61_file* f) {
+    struct stat s;
+    int r = fstat(f->fd, &s);
+    if (r >= 0 && S_ISREG(s.st_mode)) {
+        return s.st_size;
+    } else {
+        return -1;
+    }
+}